@@ -1,15 +1,31 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #define USAGE_ERR \
     do { \
-        fprintf(stderr, "USAGE: %s\n" \
+        fprintf(stderr, "USAGE: %s [-t N_TREES] [-a none|pin|numa|migrate] [-T AUTOTUNE_OUTFILE]\n" \
+            "  [-r RECORD_FILE | -p REPLAY_FILE] [-E sync|lock]\n" \
             "  N_GNOMES ORNAMENT_INSTALLATION_TIME_MICROSECONDS\n" \
             "  ORNAMENTS_PER_DELIVERY DELIVERY_INTERVAL_MICROSECONDS N_LEVELS\n" \
             "  GNOME_CAP_0 GNOME_CAP_1 ... GNOME_CAP_N_LEVELS-1\n" \
-            "  ORNAMENT_CAP_0 ORNAMENT_CAP_1 ... ORNAMENT_CAP_N_LEVELS-1\n", argv[0]); \
+            "  ORNAMENT_CAP_0 ORNAMENT_CAP_1 ... ORNAMENT_CAP_N_LEVELS-1\n" \
+            "-E sync -p RECORD_FILE checks the record against the model\n", argv[0]); \
         exit(1); \
     } while (0);
 
@@ -52,9 +68,31 @@ struct level {
 
     /* enable waiting for a gnome to free a place from one level down */
 
+    /* the node the level's pages are on, -1 if the kernel can't tell, */
+    /* looked up once they're touched, the pages never move afterwards */
+    int node;
+
+/* neighbouring levels are used by different gnomes, keep them on separate cache lines */
+} __attribute__((aligned(64)));
+
+struct ornament_delivery {
+    unsigned n_gnomes_waiting;
+    unsigned ornaments_per_delivery;
+    useconds_t interval_microseconds;
+    unsigned n_ornaments_current;
+
+    /* set once every ornament is hanged, no more deliveries after that */
+    unsigned char closed;
+
+    /* guards everything above, santa sleeps on the cond between deliveries */
+    pthread_mutex_t n_ornaments_mutex;
+    pthread_cond_t n_ornaments_cond;
 };
 
 struct xmas_tree {
+    /* the index of this tree in the farm */
+    unsigned id;
+
     /* note that levels are indexed from 0 */
     unsigned n_levels;
 
@@ -72,53 +110,454 @@ struct xmas_tree {
     /* used to synchronize moving up from the ground floor to level 0 */
     pthread_mutex_t entrance_mutex;
     pthread_cond_t entrance_cond;
+
+    /* every tree is supplied by its own santa */
+    struct ornament_delivery delivery;
+
+    /* the number of ornaments hanged so far and needed to finish this tree */
+    unsigned long long ornaments_cur;
+    unsigned long long ornaments_max;
+
+    /* ornaments picked up here by gnomes whose home is another tree */
+    unsigned long long n_stolen;
+
+    /* when the last ornament got hanged, valid once ornaments_cur == ornaments_max */
+    struct timespec completed_at;
+
+    /* ensure exclusive access to the counters above */
+    pthread_mutex_t ornaments_mutex;
 };
 
-struct ornament_delivery {
-    unsigned n_gnomes_waiting;
-    unsigned ornaments_per_delivery;
-    useconds_t interval_microseconds;
-    unsigned n_ornaments_current;
-    pthread_mutex_t n_ornaments_mutex;
-    pthread_cond_t n_ornaments_cond;
+/* a set of trees sharing one gnome workforce */
+struct xmas_farm {
+    unsigned n_trees;
+
+    struct xmas_tree *trees;
+
+    /* the number of trees with every ornament hanged */
+    unsigned n_trees_done;
+
+    /* bumped on every delivery and every finished tree, lets idle gnomes */
+    /* tell whether anything changed since they last looked for ornaments */
+    unsigned long long delivery_seq;
+
+    /* idle gnomes on the ground floor park here, guards the fields above */
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+
+    struct timespec started_at;
+
+    /* when the last tree got finished, valid once every thread is joined */
+    struct timespec completed_at;
 };
 
 static useconds_t installation_time;
-static unsigned long long ornaments_max;
-static unsigned long long ornaments_cur = 0;
-static pthread_mutex_t ornaments_mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct xmas_tree tree;
-static struct ornament_delivery delivery;
+static struct xmas_farm farm;
+
+/* returns the number of seconds between two points in time */
+double seconds_between(const struct timespec *start, const struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec)
+        + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+enum affinity_mode {
+    /* leave the placement to the scheduler */
+    AFFINITY_NONE,
+
+    /* pin every gnome to a core of its own, round-robin */
+    AFFINITY_PIN,
+
+    /* place every tree on a numa node, its levels and its home gnomes with it */
+    AFFINITY_NUMA,
+
+    /* like numa, but gnomes follow the tree and the band of levels they work on */
+    AFFINITY_MIGRATE,
+};
+
+struct affinity {
+    enum affinity_mode mode;
+
+    /* the cpus this process may run on, in ascending order */
+    unsigned n_cpus;
+    int *cpus;
+
+    /* numa nodes with at least one of those cpus, a single one if unknown */
+    unsigned n_nodes;
+    unsigned *n_node_cpus;
+    int **node_cpus;
+
+    /* the kernel's number of every node, -1 for the one made of unlisted cpus */
+    int *node_ids;
+
+    /* node_of_cpu[cpu] is the node index of an allowed cpu, -1 otherwise */
+    int max_cpu;
+    int *node_of_cpu;
+
+    /* level accesses made from the node the level's memory is on and from elsewhere */
+    unsigned long long n_local;
+    unsigned long long n_remote;
+
+    /* ensure exclusive access to the counters above */
+    pthread_mutex_t mutex;
+};
+
+static struct affinity affinity;
+
+/* the names of the modes on the command line, indexed by enum affinity_mode */
+static const char *affinity_modes[] = { "none", "pin", "numa", "migrate" };
 
-/* initializes the global tree variable */
+/* parses a sysfs cpulist such as "0-3,8,10-11" into a cpu set */
+void parse_cpulist(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list != '\0' && *list != '\n') {
+        char *endptr;
+        long first = strtol(list, &endptr, 10);
+        if (endptr == list) {
+            return;
+        }
+        long last = first;
+        if (*endptr == '-') {
+            list = endptr + 1;
+            last = strtol(list, &endptr, 10);
+            if (endptr == list) {
+                return;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        list = *endptr == ',' ? endptr + 1 : endptr;
+    }
+}
+
+/* reads the numa topology from sysfs, limited to the cpus this process may use */
 /* returns 0 on success, -1 on failure */
-int init_xmas_tree(
-    unsigned n_gnomes,
-    unsigned n_levels,
-    unsigned *gnome_cap_list,
-    unsigned *ornament_cap_list
-) {
+int init_affinity(enum affinity_mode mode) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "init_affinity: failed to get the allowed cpus\n");
+        return -1;
+    }
+
+    unsigned n_cpus = CPU_COUNT(&allowed);
+    int max_cpu = -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            max_cpu = cpu;
+        }
+    }
+
+    int *cpus = malloc(n_cpus * sizeof(int));
+    int *node_of_cpu = malloc((max_cpu + 1) * sizeof(int));
+    unsigned *n_node_cpus = calloc(n_cpus, sizeof(unsigned));
+    int **node_cpus = calloc(n_cpus, sizeof(int *));
+    int *node_ids = malloc(n_cpus * sizeof(int));
+    if (cpus == (int *)0 || node_of_cpu == (int *)0
+            || n_node_cpus == (unsigned *)0 || node_cpus == (int **)0 || node_ids == (int *)0) {
+        free(cpus);
+        free(node_of_cpu);
+        free(n_node_cpus);
+        free(node_cpus);
+        free(node_ids);
+        fprintf(stderr, "init_affinity: failed to malloc the cpu lists\n");
+        return -1;
+    }
+
+    for (int cpu = 0, i = 0; cpu <= max_cpu; cpu++) {
+        node_of_cpu[cpu] = -1;
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[i++] = cpu;
+        }
+    }
+
+    // every allowed cpu belongs to exactly one node, so there are at most n_cpus of them
+    unsigned n_nodes = 0;
+    DIR *dir = opendir("/sys/devices/system/node");
+    struct dirent *entry;
+    while (dir != (DIR *)0 && (entry = readdir(dir)) != (struct dirent *)0) {
+        char *endptr;
+        if (strncmp(entry->d_name, "node", 4) != 0) {
+            continue;
+        }
+        long node_id = strtol(entry->d_name + 4, &endptr, 10);
+        if (endptr == entry->d_name + 4 || *endptr != '\0') {
+            continue;
+        }
+
+        char path[300];
+        char list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        FILE *file = fopen(path, "r");
+        if (file == (FILE *)0) {
+            continue;
+        }
+        if (fgets(list, sizeof(list), file) == (char *)0) {
+            list[0] = '\0';
+        }
+        fclose(file);
+
+        cpu_set_t node_set;
+        parse_cpulist(list, &node_set);
+        CPU_AND(&node_set, &node_set, &allowed);
+        unsigned n_node_set = CPU_COUNT(&node_set);
+        if (n_node_set == 0) {
+            continue;
+        }
+
+        node_cpus[n_nodes] = malloc(n_node_set * sizeof(int));
+        if (node_cpus[n_nodes] == (int *)0) {
+            continue;
+        }
+        for (size_t i = 0; i < n_cpus; i++) {
+            if (CPU_ISSET(cpus[i], &node_set) && node_of_cpu[cpus[i]] == -1) {
+                node_of_cpu[cpus[i]] = n_nodes;
+                node_cpus[n_nodes][n_node_cpus[n_nodes]++] = cpus[i];
+            }
+        }
+        if (n_node_cpus[n_nodes] == 0) {
+            free(node_cpus[n_nodes]);
+            node_cpus[n_nodes] = (int *)0;
+            continue;
+        }
+        node_ids[n_nodes] = node_id;
+        n_nodes += 1;
+    }
+    if (dir != (DIR *)0) {
+        closedir(dir);
+    }
+
+    // no numa information, or some cpus were not listed: treat them as one more node
+    unsigned n_orphans = 0;
+    for (size_t i = 0; i < n_cpus; i++) {
+        n_orphans += node_of_cpu[cpus[i]] == -1;
+    }
+    if (n_orphans > 0) {
+        node_cpus[n_nodes] = malloc(n_orphans * sizeof(int));
+        if (node_cpus[n_nodes] == (int *)0) {
+            for (size_t i = 0; i <= n_nodes; i++) {
+                free(node_cpus[i]);
+            }
+            free(cpus);
+            free(node_of_cpu);
+            free(n_node_cpus);
+            free(node_cpus);
+            free(node_ids);
+            fprintf(stderr, "init_affinity: failed to malloc the cpu lists\n");
+            return -1;
+        }
+        for (size_t i = 0; i < n_cpus; i++) {
+            if (node_of_cpu[cpus[i]] == -1) {
+                node_of_cpu[cpus[i]] = n_nodes;
+                node_cpus[n_nodes][n_node_cpus[n_nodes]++] = cpus[i];
+            }
+        }
+        node_ids[n_nodes] = -1;
+        n_nodes += 1;
+    }
+
+    if (pthread_mutex_init(&affinity.mutex, NULL) != 0) {
+        for (size_t i = 0; i < n_nodes; i++) {
+            free(node_cpus[i]);
+        }
+        free(cpus);
+        free(node_of_cpu);
+        free(n_node_cpus);
+        free(node_cpus);
+        free(node_ids);
+        fprintf(stderr, "init_affinity: failed to initialize the mutex\n");
+        return -1;
+    }
+
+    affinity.mode = mode;
+    affinity.n_cpus = n_cpus;
+    affinity.cpus = cpus;
+    affinity.n_nodes = n_nodes;
+    affinity.n_node_cpus = n_node_cpus;
+    affinity.node_cpus = node_cpus;
+    affinity.node_ids = node_ids;
+    affinity.max_cpu = max_cpu;
+    affinity.node_of_cpu = node_of_cpu;
+    affinity.n_local = 0;
+    affinity.n_remote = 0;
+
+    return 0;
+}
+
+void kill_affinity() {
+    for (size_t i = 0; i < affinity.n_nodes; i++) {
+        free(affinity.node_cpus[i]);
+    }
+    free(affinity.cpus);
+    free(affinity.node_of_cpu);
+    free(affinity.n_node_cpus);
+    free(affinity.node_cpus);
+    free(affinity.node_ids);
+    pthread_mutex_destroy(&affinity.mutex);
+}
+
+/* restricts the calling thread to the given cpus */
+/* returns 0 on success, -1 on failure */
+int bind_to_cpus(const int *cpus, unsigned n_cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < n_cpus; i++) {
+        CPU_SET(cpus[i], &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "bind_to_cpus: failed to set the thread affinity\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* the node a tree is placed on, the levels live there in the numa modes */
+unsigned home_node_of(unsigned tree_id) {
+    return tree_id % affinity.n_nodes;
+}
+
+/* called by the main thread before a tree is initialized, */
+/* so its levels are first touched, hence allocated, on the tree's node */
+void place_tree(unsigned tree_id) {
+    if (affinity.mode == AFFINITY_NUMA || affinity.mode == AFFINITY_MIGRATE) {
+        unsigned node = home_node_of(tree_id);
+        bind_to_cpus(affinity.node_cpus[node], affinity.n_node_cpus[node]);
+    }
+}
+
+/* undoes place_tree, the main thread may run anywhere again */
+void unplace_main_thread() {
+    if (affinity.mode == AFFINITY_NUMA || affinity.mode == AFFINITY_MIGRATE) {
+        bind_to_cpus(affinity.cpus, affinity.n_cpus);
+    }
+}
+
+/* called by every gnome once, before it starts working on its home tree */
+void place_gnome(unsigned gnome_id, unsigned home_id) {
+    if (affinity.mode == AFFINITY_PIN) {
+        bind_to_cpus(&affinity.cpus[gnome_id % affinity.n_cpus], 1);
+    } else if (affinity.mode == AFFINITY_NUMA || affinity.mode == AFFINITY_MIGRATE) {
+        unsigned node = home_node_of(home_id);
+        bind_to_cpus(affinity.node_cpus[node], affinity.n_node_cpus[node]);
+    }
+}
+
+/* in the migrate mode, moves the gnome next to the tree and the levels it works on */
+/* the node's cpus are split into bands of adjacent levels, the ground floor gets them all */
+/* `*placed_band` remembers the last placement to skip needless migrations */
+void follow_gnome(struct xmas_tree *tree, long level, long *placed_band) {
+    if (affinity.mode != AFFINITY_MIGRATE) {
+        return;
+    }
+
+    unsigned node = home_node_of(tree->id);
+    unsigned n_cpus = affinity.n_node_cpus[node];
+    unsigned n_bands = n_cpus < tree->n_levels ? n_cpus : tree->n_levels;
+
+    // bands are numbered across the farm so that changing trees always migrates
+    long band = level < 0 ? -1 : level * n_bands / tree->n_levels;
+    long farm_band = (long)tree->id * (tree->n_levels + 1) + band + 1;
+    if (farm_band == *placed_band) {
+        return;
+    }
+    *placed_band = farm_band;
+
+    if (band == -1) {
+        bind_to_cpus(affinity.node_cpus[node], n_cpus);
+    } else {
+        unsigned first = band * n_cpus / n_bands;
+        unsigned last = (band + 1) * n_cpus / n_bands;
+        bind_to_cpus(&affinity.node_cpus[node][first], last - first);
+    }
+}
+
+/* the kernel's number of the node the page holding `address` is on */
+/* returns -1 if the kernel can't tell */
+int node_of_address(const void *address) {
+    int node;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, address, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+        return -1;
+    }
+    return node;
+}
+
+/* tells whether the calling thread is running on the node the level's memory is on */
+/* returns 1 if it is, 0 if it isn't, -1 if that can't be told */
+int on_level_node(const struct level *level) {
+    // a single node, wherever the pages are, they are local
+    if (affinity.n_nodes == 1) {
+        return 1;
+    }
+
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu > affinity.max_cpu || affinity.node_of_cpu[cpu] == -1 || level->node == -1) {
+        return -1;
+    }
+    return affinity.node_ids[affinity.node_of_cpu[cpu]] == level->node;
+}
+
+/* adds the level accesses counted by a gnome to the totals */
+void add_locality(unsigned long long n_local, unsigned long long n_remote) {
+    pthread_mutex_lock(&affinity.mutex);
+    affinity.n_local += n_local;
+    affinity.n_remote += n_remote;
+    pthread_mutex_unlock(&affinity.mutex);
+}
+
+/* levels get pages of their own, so they are placed where init_xmas_tree first touches them */
+/* returns NULL on failure */
+struct level *alloc_levels(unsigned n_levels) {
+    void *levels = mmap(NULL, n_levels * sizeof(struct level),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (levels == MAP_FAILED) {
+        return (struct level *)0;
+    }
+    return (struct level *)levels;
+}
+
+void free_levels(struct level *levels, unsigned n_levels) {
+    munmap(levels, n_levels * sizeof(struct level));
+}
+
+/* checks the shape of a tree, the explorer only models trees that pass it too */
+/* returns 0 if a tree can be built that way, -1 if not */
+int check_xmas_tree(unsigned n_gnomes, unsigned n_levels, const unsigned *gnome_cap_list) {
     if (n_levels == 0) {
-        fprintf(stderr, "init_xmas_tree: "
-            "n_levels must be a positive integer");
+        fprintf(stderr, "check_xmas_tree: "
+            "n_levels must be a positive integer\n");
         return -1;
     }
 
     if (n_gnomes == 0) {
-        fprintf(stderr, "init_xmas_tree: "
-            "n_gnomes must be a positive integer");
+        fprintf(stderr, "check_xmas_tree: "
+            "n_gnomes must be a positive integer\n");
         return -1;
     }
 
     for (size_t i = 1; i < n_levels; i++) {
         if (gnome_cap_list[i] >= gnome_cap_list[i - 1]) {
-            fprintf(stderr, "init_xmas_tree: "
+            fprintf(stderr, "check_xmas_tree: "
                 "gnomes_cap must be greater on each level than on the level above\n");
             return -1;
         }
     }
+    return 0;
+}
+
+/* initializes a single tree of the farm */
+/* returns 0 on success, -1 on failure */
+int init_xmas_tree(
+    struct xmas_tree *tree,
+    unsigned id,
+    unsigned n_gnomes,
+    unsigned n_levels,
+    unsigned *gnome_cap_list,
+    unsigned *ornament_cap_list
+) {
+    if (check_xmas_tree(n_gnomes, n_levels, gnome_cap_list) == -1) {
+        return -1;
+    }
 
-    struct level *levels = malloc(n_levels * sizeof(struct level));
+    struct level *levels = alloc_levels(n_levels);
     if (levels == (struct level *)0) {
         fprintf(stderr, "init_xmas_tree: "
             "failed to malloc the `levels` list\n");
@@ -144,7 +583,7 @@ int init_xmas_tree(
             for (size_t j = 0; j < i; j++) {
                 pthread_mutex_destroy(&levels[j].n_gnomes_mutex);
             }
-            free(levels);
+            free_levels(levels, n_levels);
             fprintf(stderr, "init_xmas_tree: "
                 "failed to initialize n_gnomes_mutex for levels[%lu]\n", i);
             return -1;
@@ -156,7 +595,7 @@ int init_xmas_tree(
             for (size_t j = 0; j < i; j++) {
                 pthread_mutex_destroy(&levels[j].n_ornaments_mutex);
             }
-            free(levels);
+            free_levels(levels, n_levels);
             fprintf(stderr, "init_xmas_tree: "
                 "failed to initialize n_ornaments_mutex for levels[%lu]\n", i);
             return -1;
@@ -169,7 +608,7 @@ int init_xmas_tree(
             for (size_t j = 0; j < i; j++) {
                 pthread_mutex_destroy(&levels[j].go_up_mutex);
             }
-            free(levels);
+            free_levels(levels, n_levels);
             fprintf(stderr, "init_xmas_tree: "
                 "failed to initialize go_up_mutex for levels[%lu]\n", i);
             return -1;
@@ -183,7 +622,7 @@ int init_xmas_tree(
             for (size_t j = 0; j < i; j++) {
                 pthread_mutex_destroy(&levels[j].go_down_mutex);
             }
-            free(levels);
+            free_levels(levels, n_levels);
             fprintf(stderr, "init_xmas_tree: "
                 "failed to initialize go_down_mutex for levels[%lu]\n", i);
             return -1;
@@ -198,7 +637,7 @@ int init_xmas_tree(
             for (size_t j = 0; j < i; j++) {
                 pthread_cond_destroy(&levels[j].go_up_cond);
             }
-            free(levels);
+            free_levels(levels, n_levels);
             fprintf(stderr, "init_xmas_tree: "
                 "failed to initialize go_up_cond for levels[%lu]\n", i);
             return -1;
@@ -214,14 +653,14 @@ int init_xmas_tree(
             for (size_t j = 0; j < i; j++) {
                 pthread_cond_destroy(&levels[j].go_down_cond);
             }
-            free(levels);
+            free_levels(levels, n_levels);
             fprintf(stderr, "init_xmas_tree: "
                 "failed to initialize go_down_cond for levels[%lu]\n", i);
             return -1;
         }
     }
 
-    if (pthread_mutex_init(&tree.entrance_mutex, NULL) != 0) {
+    if (pthread_mutex_init(&tree->entrance_mutex, NULL) != 0) {
         for (size_t i = 0; i < n_levels; i++) {
             pthread_mutex_destroy(&levels[i].n_gnomes_mutex);
             pthread_mutex_destroy(&levels[i].n_ornaments_mutex);
@@ -230,12 +669,13 @@ int init_xmas_tree(
             pthread_cond_destroy(&levels[i].go_up_cond);
             pthread_cond_destroy(&levels[i].go_down_cond);
         }
-        free(levels);
+        free_levels(levels, n_levels);
         fprintf(stderr, "init_xmas_tree: "
             "failed to initialize entrance_mutex\n");
+        return -1;
     }
 
-    if (pthread_cond_init(&tree.entrance_cond, NULL) != 0) {
+    if (pthread_cond_init(&tree->entrance_cond, NULL) != 0) {
         for (size_t i = 0; i < n_levels; i++) {
             pthread_mutex_destroy(&levels[i].n_gnomes_mutex);
             pthread_mutex_destroy(&levels[i].n_ornaments_mutex);
@@ -244,203 +684,834 @@ int init_xmas_tree(
             pthread_cond_destroy(&levels[i].go_up_cond);
             pthread_cond_destroy(&levels[i].go_down_cond);
         }
-        free(levels);
-        pthread_cond_destroy(&tree.entrance_cond);
+        free_levels(levels, n_levels);
+        pthread_mutex_destroy(&tree->entrance_mutex);
         fprintf(stderr, "init_xmas_tree: "
             "failed to initialize entrance_cond\n");
+        return -1;
     }
-    
-    tree.n_levels = n_levels;
-    tree.levels = levels;
-    tree.n_gnomes = n_gnomes;
-    tree.gnome_positions = gnome_positions;
-    tree.next_enter_id = -1;
+
+    if (pthread_mutex_init(&tree->ornaments_mutex, NULL) != 0) {
+        for (size_t i = 0; i < n_levels; i++) {
+            pthread_mutex_destroy(&levels[i].n_gnomes_mutex);
+            pthread_mutex_destroy(&levels[i].n_ornaments_mutex);
+            pthread_mutex_destroy(&levels[i].go_up_mutex);
+            pthread_mutex_destroy(&levels[i].go_down_mutex);
+            pthread_cond_destroy(&levels[i].go_up_cond);
+            pthread_cond_destroy(&levels[i].go_down_cond);
+        }
+        free_levels(levels, n_levels);
+        pthread_mutex_destroy(&tree->entrance_mutex);
+        pthread_cond_destroy(&tree->entrance_cond);
+        fprintf(stderr, "init_xmas_tree: "
+            "failed to initialize ornaments_mutex\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < n_gnomes; i++) {
+        gnome_positions[i] = -1;
+    }
+
+    // every page of the levels has been touched above
+    for (size_t i = 0; i < n_levels; i++) {
+        levels[i].node = affinity.n_nodes > 1 ? node_of_address(&levels[i]) : -1;
+    }
+
+    tree->id = id;
+    tree->n_levels = n_levels;
+    tree->levels = levels;
+    tree->n_gnomes = n_gnomes;
+    tree->gnome_positions = gnome_positions;
+    tree->next_enter_id = -1;
+    tree->ornaments_cur = 0;
+    tree->ornaments_max = 0;
+    for (size_t i = 0; i < n_levels; i++) {
+        tree->ornaments_max += ornament_cap_list[i];
+    }
+    tree->n_stolen = 0;
 
     return 0;
 }
 
-/* deallocates memory associated with the global tree variable */
-void kill_xmas_tree() {
-    for (size_t i = 0; i < tree.n_levels; i++) {
-        pthread_mutex_destroy(&tree.levels[i].n_gnomes_mutex);
-        pthread_mutex_destroy(&tree.levels[i].n_ornaments_mutex);
-        pthread_mutex_destroy(&tree.levels[i].go_up_mutex);
-        pthread_mutex_destroy(&tree.levels[i].go_down_mutex);
-        pthread_cond_destroy(&tree.levels[i].go_up_cond);
-        pthread_cond_destroy(&tree.levels[i].go_down_cond);
+/* deallocates memory associated with a tree, the delivery is killed separately */
+void kill_xmas_tree(struct xmas_tree *tree) {
+    for (size_t i = 0; i < tree->n_levels; i++) {
+        pthread_mutex_destroy(&tree->levels[i].n_gnomes_mutex);
+        pthread_mutex_destroy(&tree->levels[i].n_ornaments_mutex);
+        pthread_mutex_destroy(&tree->levels[i].go_up_mutex);
+        pthread_mutex_destroy(&tree->levels[i].go_down_mutex);
+        pthread_cond_destroy(&tree->levels[i].go_up_cond);
+        pthread_cond_destroy(&tree->levels[i].go_down_cond);
     }
-    free(tree.levels);
+    pthread_mutex_destroy(&tree->entrance_mutex);
+    pthread_cond_destroy(&tree->entrance_cond);
+    pthread_mutex_destroy(&tree->ornaments_mutex);
+    free_levels(tree->levels, tree->n_levels);
+    free(tree->gnome_positions);
 }
 
 int init_ornament_delivery(
+    struct ornament_delivery *delivery,
     unsigned ornaments_per_delivery,
     useconds_t delivery_interval
 ) {
-    delivery.n_gnomes_waiting = 0;
-    delivery.ornaments_per_delivery = ornaments_per_delivery;
-    delivery.interval_microseconds = delivery_interval;
-    delivery.n_ornaments_current = 0;
-    if (pthread_mutex_init(&delivery.n_ornaments_mutex, NULL) != 0) {
+    delivery->n_gnomes_waiting = 0;
+    delivery->ornaments_per_delivery = ornaments_per_delivery;
+    delivery->interval_microseconds = delivery_interval;
+    delivery->n_ornaments_current = 0;
+    delivery->closed = 0;
+    if (pthread_mutex_init(&delivery->n_ornaments_mutex, NULL) != 0) {
         fprintf(stderr,
             "init_ornament_delivery: failed to initialize the mutex\n");
         return -1;
     }
-    if (pthread_cond_init(&delivery.n_ornaments_cond, NULL) != 0) {
-        pthread_mutex_destroy(&delivery.n_ornaments_mutex);
+
+    // santa sleeps on the cond with a deadline, so it must not follow the wall clock
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&delivery->n_ornaments_cond, &cond_attr) != 0) {
+        pthread_condattr_destroy(&cond_attr);
+        pthread_mutex_destroy(&delivery->n_ornaments_mutex);
         fprintf(stderr,
             "init_ornament_delivery: failed to initialize the condition variable\n");
         return -1;
     }
+    pthread_condattr_destroy(&cond_attr);
 
     return 0;
 }
 
-void kill_ornament_delivery() {
-    pthread_mutex_destroy(&delivery.n_ornaments_mutex);
-    pthread_cond_destroy(&delivery.n_ornaments_cond);
+/* stops santa, the tree it supplies is finished */
+/* returns 1 if this call closed it, 0 if it was closed already */
+unsigned char close_ornament_delivery(struct ornament_delivery *delivery) {
+    pthread_mutex_lock(&delivery->n_ornaments_mutex);
+    unsigned char was_open = !delivery->closed;
+    delivery->closed = 1;
+    pthread_cond_broadcast(&delivery->n_ornaments_cond);
+    pthread_mutex_unlock(&delivery->n_ornaments_mutex);
+    return was_open;
 }
 
-// call this every time to increment the global counter
-void *ornament_hanged(void *arg) {
-    pthread_mutex_lock(&ornaments_mutex);
-    printf("ornament#%llu hanged\n", ornaments_cur);
-    ornaments_cur += 1;
-    pthread_mutex_unlock(&ornaments_mutex);
-
-    return NULL;
+void kill_ornament_delivery(struct ornament_delivery *delivery) {
+    pthread_mutex_destroy(&delivery->n_ornaments_mutex);
+    pthread_cond_destroy(&delivery->n_ornaments_cond);
 }
 
-long go_up_the_tree(long level, unsigned gnome_id) {
-    if (level == tree.n_levels - 1) {
-        printf("gnome#%u stays at level#%ld", gnome_id, level);
-        return level;
+/* initializes the global farm variable, the trees themselves are initialized separately */
+/* returns 0 on success, -1 on failure */
+int init_xmas_farm(unsigned n_trees) {
+    if (n_trees == 0) {
+        fprintf(stderr, "init_xmas_farm: "
+            "n_trees must be a positive integer\n");
+        return -1;
     }
 
-    long *next_down_id = &tree.levels[level + 1].next_down_id;
-    pthread_mutex_t *go_down_mutex = &tree.levels[level + 1].go_down_mutex;
-    pthread_cond_t *go_down_cond = &tree.levels[level + 1].go_down_cond;
-
-    long *next_up_id;
-    pthread_mutex_t *go_up_mutex;
-    pthread_cond_t *go_up_cond;
-    if (level == -1) {
-        next_up_id = &tree.next_enter_id;
-        go_up_mutex = &tree.entrance_mutex;
-        go_up_cond = &tree.entrance_cond;
-    } else {
-        next_up_id = &tree.levels[level].next_up_id;
-        go_up_mutex = &tree.levels[level].go_up_mutex;
-        go_up_cond = &tree.levels[level].go_up_cond;
+    struct xmas_tree *trees = malloc(n_trees * sizeof(struct xmas_tree));
+    if (trees == (struct xmas_tree *)0) {
+        fprintf(stderr, "init_xmas_farm: "
+            "failed to malloc the `trees` list\n");
+        return -1;
     }
-    
-    while (tree.levels[level + 1].n_gnomes_current == tree.levels[level + 1].gnome_cap) {
-        printf("gnome#%u is waiting to go up to level#%ld\n", gnome_id, level + 1);
 
-        pthread_mutex_lock(go_up_mutex);
-        long up_id = *next_up_id; 
-        pthread_mutex_unlock(go_up_mutex);
-        pthread_mutex_lock(go_down_mutex);
-        long down_id = *next_down_id;
-        pthread_mutex_unlock(go_down_mutex);
+    if (pthread_mutex_init(&farm.idle_mutex, NULL) != 0) {
+        free(trees);
+        fprintf(stderr, "init_xmas_farm: "
+            "failed to initialize idle_mutex\n");
+        return -1;
+    }
 
-        // if somebody's waiting on the upper level, swap
-        if (up_id == -1 && down_id != -1) {
-            pthread_mutex_lock(go_up_mutex);
-            *next_up_id = gnome_id;
-            pthread_mutex_unlock(go_up_mutex);
+    if (pthread_cond_init(&farm.idle_cond, NULL) != 0) {
+        pthread_mutex_destroy(&farm.idle_mutex);
+        free(trees);
+        fprintf(stderr, "init_xmas_farm: "
+            "failed to initialize idle_cond\n");
+        return -1;
+    }
 
-            pthread_cond_broadcast(go_down_cond);
+    farm.n_trees = n_trees;
+    farm.trees = trees;
+    farm.n_trees_done = 0;
+    farm.delivery_seq = 0;
+    clock_gettime(CLOCK_MONOTONIC, &farm.started_at);
 
-            printf("gnome#%u initiates a swap up to level#%ld\n", gnome_id, level + 1);
-            return level + 1;
-        }
+    return 0;
+}
 
-        // if next_up_id is unset, set it to your id (occupy the queue)
-        if (up_id == -1) {
-            pthread_mutex_lock(go_up_mutex);
-            *next_up_id = (long)gnome_id;
-            up_id = (long)gnome_id;
-            pthread_mutex_unlock(go_up_mutex);
-        }
+/* deallocates memory associated with the global farm variable */
+/* every tree and delivery must have been killed already */
+void kill_xmas_farm() {
+    pthread_mutex_destroy(&farm.idle_mutex);
+    pthread_cond_destroy(&farm.idle_cond);
+    free(farm.trees);
+}
 
-        if (up_id != (long)gnome_id || down_id == -1) {
-            pthread_mutex_lock(go_up_mutex);
-            pthread_cond_wait(go_up_cond, go_up_mutex);
-            pthread_mutex_unlock(go_up_mutex);
-            continue;
-        }
+/* wakes the idle gnomes, something worth looking at has happened */
+void notify_idle_gnomes(unsigned char tree_done) {
+    pthread_mutex_lock(&farm.idle_mutex);
+    farm.delivery_seq += 1;
+    if (tree_done) {
+        farm.n_trees_done += 1;
+    }
+    pthread_cond_broadcast(&farm.idle_cond);
+    pthread_mutex_unlock(&farm.idle_mutex);
+}
 
-        // if this was reached, it means that the upper level wants to swap
-        pthread_mutex_lock(go_up_mutex);
-        pthread_mutex_lock(go_down_mutex);
-        *next_up_id = -1;
-        *next_down_id = -1;
-        pthread_cond_broadcast(go_up_cond);
-        pthread_cond_broadcast(go_down_cond);
-        pthread_mutex_unlock(go_down_mutex);
-        pthread_mutex_unlock(go_up_mutex);
+/* the completion event of a tree: stops its santa and lets the farm know */
+/* a tree is only counted done once, abort_xmas_farm may have closed it first */
+void finish_xmas_tree(struct xmas_tree *tree) {
+    printf("tree#%u: all ornaments hanged\n", tree->id);
+    notify_idle_gnomes(close_ornament_delivery(&tree->delivery));
+}
 
-        printf("gnome#%u follows up on a swap up to level #%lu\n", gnome_id, level + 1);
-        return level + 1;
+/* ends a run before its trees are finished: no more ornaments get picked up, */
+/* so the gnomes already running hang or throw the ones they carry and rest, */
+/* and every santa goes home */
+void abort_xmas_farm() {
+    for (size_t i = 0; i < farm.n_trees; i++) {
+        notify_idle_gnomes(close_ornament_delivery(&farm.trees[i].delivery));
     }
+}
 
-    // if this was reached, it means there's a free space on the upper level
+enum sync_mode {
+    /* threads go as the scheduler lets them */
+    SYNC_FREE,
 
-    pthread_mutex_lock(go_up_mutex);
+    /* every synchronization decision is logged, in the order they were taken */
+    SYNC_RECORD,
+
+    /* every synchronization decision waits for its turn in a recorded log */
+    SYNC_REPLAY,
+};
+
+/* what a step of a gnome or a santa did, the outcome of one synchronization decision */
+enum sync_kind {
+    SYNC_PICK_UP = 1,
+    SYNC_PICK_NONE,
+    SYNC_CLAIM_UP,
+    SYNC_WAIT_UP,
+    SYNC_SWAP_INIT_UP,
+    SYNC_SWAP_FOLLOW_UP,
+    SYNC_MOVE_UP,
+    SYNC_CLAIM_DOWN,
+    SYNC_WAIT_DOWN,
+    SYNC_SWAP_INIT_DOWN,
+    SYNC_SWAP_FOLLOW_DOWN,
+    SYNC_MOVE_DOWN,
+    SYNC_HANG_START,
+    SYNC_HANG_FULL,
+    SYNC_HANG_DONE,
+    SYNC_DELIVER,
+    SYNC_SANTA_LEAVE,
+};
+
+static const char *sync_kinds[] = {
+    "does nothing", "picks up an ornament", "finds nothing to pick up",
+    "claims the queue up", "waits to go up", "initiates a swap up", "follows a swap up",
+    "moves up",
+    "claims the queue down", "waits to go down", "initiates a swap down", "follows a swap down",
+    "moves down",
+    "starts hanging an ornament", "finds the level full", "finishes hanging an ornament",
+    "delivers", "leaves",
+};
+
+/* or'ed into the kind of the first step after waking up on a cond */
+#define SYNC_WOKEN 0x80
+
+/* the partner of a step that has none */
+#define SYNC_NOBODY 0xffff
+
+/* one step as it is stored in a record file */
+struct sync_event {
+    /* gnomes are actors 0..N_GNOMES-1, the santa of tree t is N_GNOMES + t */
+    uint16_t actor;
+
+    /* for swaps: the gnome on the other side, SYNC_NOBODY otherwise */
+    uint16_t partner;
+
+    /* the gnomes woken by the signals of the step in the order they were sent, */
+    /* SYNC_NOBODY for a signal nobody waited for and for no signal at all */
+    uint16_t woken[2];
+
+    uint16_t tree;
+    int8_t level;
+    uint8_t kind;
+};
+
+/* the first bytes of a record file */
+struct sync_header {
+    char magic[4];
+    uint16_t n_gnomes;
+    uint16_t n_trees;
+    uint16_t n_levels;
+
+    /* sizeof(struct sync_event) of the build that recorded it */
+    uint16_t event_size;
+    uint64_t n_events;
+};
+
+struct sync_log {
+    enum sync_mode mode;
+
+    unsigned n_gnomes;
+
+    struct sync_event *events;
+    size_t n_events;
+    size_t capacity;
+
+    /* replay: the next event to be taken, and whether the run went its own way */
+    size_t head;
+    unsigned char diverged;
+
+    /* replay: how long an actor waits for its turn before giving up on the log */
+    struct timespec patience;
+
+    /* replay: how long the run stood still waiting for steps that never came */
+    double stalled_seconds;
+
+    /* the cond every gnome waits on (NULL if none) and the order they started waiting */
+    /* in, wakers pick whom to wake from these so that it is up to the log, not the */
+    /* scheduler. A gnome's entries are only changed under the mutex of its cond */
+    pthread_cond_t **waiting_on;
+    unsigned long long *waiting_since;
+    unsigned long long n_waits;
+
+    /* the gnomes woken by the signals of the step being taken */
+    uint16_t woken[2];
+    unsigned n_woken;
+
+    /* record: held by the actor taking a step, replay: guards the fields above */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static struct sync_log sync_log;
+
+/* prepares recording or replaying, `path` is only read when replaying */
+/* patience is the longest an actor may legitimately wait for its turn */
+/* returns 0 on success, -1 on failure */
+int init_sync_log(
+    enum sync_mode mode,
+    const char *path,
+    unsigned n_gnomes,
+    unsigned n_trees,
+    unsigned n_levels,
+    useconds_t patience
+) {
+    sync_log.mode = mode;
+    sync_log.n_gnomes = n_gnomes;
+    sync_log.events = (struct sync_event *)0;
+    sync_log.n_events = 0;
+    sync_log.capacity = 0;
+    sync_log.head = 0;
+    sync_log.diverged = 0;
+    sync_log.patience.tv_sec = patience / 1000000;
+    sync_log.patience.tv_nsec = (patience % 1000000) * 1000;
+    sync_log.stalled_seconds = 0;
+    sync_log.waiting_on = (pthread_cond_t **)0;
+    sync_log.waiting_since = (unsigned long long *)0;
+    sync_log.n_waits = 0;
+    sync_log.n_woken = 0;
+
+    if (mode == SYNC_FREE) {
+        return 0;
+    }
+
+    if (n_gnomes + n_trees > SYNC_NOBODY || n_trees > UINT16_MAX || n_levels > INT8_MAX) {
+        fprintf(stderr, "init_sync_log: "
+            "too many gnomes, trees or levels to record\n");
+        return -1;
+    }
+
+    if (mode == SYNC_REPLAY) {
+        FILE *file = fopen(path, "rb");
+        if (file == (FILE *)0) {
+            fprintf(stderr, "init_sync_log: failed to open %s\n", path);
+            return -1;
+        }
+
+        struct sync_header header;
+        if (fread(&header, sizeof(header), 1, file) != 1
+                || memcmp(header.magic, "XMSR", 4) != 0) {
+            fclose(file);
+            fprintf(stderr, "init_sync_log: %s is not a record file\n", path);
+            return -1;
+        }
+        if (header.event_size != sizeof(struct sync_event)) {
+            fclose(file);
+            fprintf(stderr, "init_sync_log: %s was recorded by a build with other events\n", path);
+            return -1;
+        }
+        if (header.n_gnomes != n_gnomes || header.n_trees != n_trees
+                || header.n_levels != n_levels) {
+            fclose(file);
+            fprintf(stderr, "init_sync_log: "
+                "%s was recorded with %u gnomes, %u trees and %u levels\n",
+                path, header.n_gnomes, header.n_trees, header.n_levels);
+            return -1;
+        }
+
+        sync_log.events = malloc((header.n_events > 0 ? header.n_events : 1) * sizeof(struct sync_event));
+        if (sync_log.events == (struct sync_event *)0) {
+            fclose(file);
+            fprintf(stderr, "init_sync_log: failed to malloc the events\n");
+            return -1;
+        }
+        if (fread(sync_log.events, sizeof(struct sync_event), header.n_events, file) != header.n_events) {
+            free(sync_log.events);
+            fclose(file);
+            fprintf(stderr, "init_sync_log: %s is truncated\n", path);
+            return -1;
+        }
+        fclose(file);
+        sync_log.n_events = header.n_events;
+        sync_log.capacity = header.n_events;
+    }
+
+    sync_log.waiting_on = calloc(n_gnomes, sizeof(pthread_cond_t *));
+    sync_log.waiting_since = calloc(n_gnomes, sizeof(unsigned long long));
+    if (sync_log.waiting_on == (pthread_cond_t **)0
+            || sync_log.waiting_since == (unsigned long long *)0) {
+        free(sync_log.waiting_on);
+        free(sync_log.waiting_since);
+        free(sync_log.events);
+        fprintf(stderr, "init_sync_log: failed to malloc the waiters\n");
+        return -1;
+    }
+
+    if (pthread_mutex_init(&sync_log.mutex, NULL) != 0) {
+        free(sync_log.waiting_on);
+        free(sync_log.waiting_since);
+        free(sync_log.events);
+        fprintf(stderr, "init_sync_log: failed to initialize the mutex\n");
+        return -1;
+    }
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&sync_log.cond, &cond_attr) != 0) {
+        pthread_condattr_destroy(&cond_attr);
+        pthread_mutex_destroy(&sync_log.mutex);
+        free(sync_log.waiting_on);
+        free(sync_log.waiting_since);
+        free(sync_log.events);
+        fprintf(stderr, "init_sync_log: failed to initialize the condition variable\n");
+        return -1;
+    }
+    pthread_condattr_destroy(&cond_attr);
+
+    return 0;
+}
+
+void kill_sync_log() {
+    if (sync_log.mode == SYNC_FREE) {
+        return;
+    }
+    pthread_mutex_destroy(&sync_log.mutex);
+    pthread_cond_destroy(&sync_log.cond);
+    free(sync_log.waiting_on);
+    free(sync_log.waiting_since);
+    free(sync_log.events);
+}
+
+/* writes the recorded steps to a record file */
+/* returns 0 on success, -1 on failure */
+int write_sync_log(const char *path, unsigned n_trees, unsigned n_levels) {
+    FILE *file = fopen(path, "wb");
+    if (file == (FILE *)0) {
+        fprintf(stderr, "write_sync_log: failed to open %s\n", path);
+        return -1;
+    }
+
+    struct sync_header header = {
+        .magic = { 'X', 'M', 'S', 'R' },
+        .n_gnomes = sync_log.n_gnomes,
+        .n_trees = n_trees,
+        .n_levels = n_levels,
+        .event_size = sizeof(struct sync_event),
+        .n_events = sync_log.n_events,
+    };
+    if (fwrite(&header, sizeof(header), 1, file) != 1
+            || fwrite(sync_log.events, sizeof(struct sync_event), sync_log.n_events, file)
+                != sync_log.n_events) {
+        fclose(file);
+        fprintf(stderr, "write_sync_log: failed to write %s\n", path);
+        return -1;
+    }
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "write_sync_log: failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* starts a step of an actor: a synchronization decision and whatever it does to shared state */
+/* must be called without holding any other lock, every step ends with sync_leave */
+void sync_enter(unsigned actor) {
+    if (sync_log.mode == SYNC_RECORD) {
+        // the steps are taken one at a time, so the log order is the order they took effect
+        pthread_mutex_lock(&sync_log.mutex);
+        return;
+    }
+    if (sync_log.mode != SYNC_REPLAY) {
+        return;
+    }
+
+    pthread_mutex_lock(&sync_log.mutex);
+    while (!sync_log.diverged) {
+        if (sync_log.head == sync_log.n_events) {
+            printf("sync: the run outlived the record after event#%lu\n", sync_log.head);
+            sync_log.diverged = 1;
+            pthread_cond_broadcast(&sync_log.cond);
+            break;
+        }
+        if (sync_log.events[sync_log.head].actor == actor) {
+            break;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += sync_log.patience.tv_sec;
+        deadline.tv_nsec += sync_log.patience.tv_nsec;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        size_t head = sync_log.head;
+        int err = 0;
+        while (!sync_log.diverged && sync_log.head == head && err != ETIMEDOUT) {
+            err = pthread_cond_timedwait(&sync_log.cond, &sync_log.mutex, &deadline);
+        }
+
+        // the actor whose turn it is never showed up
+        if (!sync_log.diverged && sync_log.head == head) {
+            printf("sync: diverged at event#%lu, actor#%u never took its step\n",
+                head, sync_log.events[head].actor);
+            sync_log.diverged = 1;
+            sync_log.stalled_seconds += sync_log.patience.tv_sec + sync_log.patience.tv_nsec / 1e9;
+            pthread_cond_broadcast(&sync_log.cond);
+        }
+    }
+    pthread_mutex_unlock(&sync_log.mutex);
+}
+
+/* ends a step started by sync_enter, stating what the step did */
+void sync_leave(unsigned actor, unsigned kind, unsigned partner, long tree_id, long level) {
+    struct sync_event event = {
+        .actor = actor,
+        .partner = partner,
+        .woken = { SYNC_NOBODY, SYNC_NOBODY },
+        .tree = tree_id < 0 ? UINT16_MAX : tree_id,
+        .level = level,
+        .kind = kind,
+    };
+
+    if (sync_log.mode == SYNC_RECORD) {
+        for (size_t i = 0; i < sync_log.n_woken; i++) {
+            event.woken[i] = sync_log.woken[i];
+        }
+        sync_log.n_woken = 0;
+
+        if (sync_log.n_events == sync_log.capacity) {
+            size_t capacity = sync_log.capacity > 0 ? 2 * sync_log.capacity : 4096;
+            struct sync_event *events = realloc(sync_log.events, capacity * sizeof(struct sync_event));
+            if (events == (struct sync_event *)0) {
+                fprintf(stderr, "sync_leave: failed to grow the record, steps are lost\n");
+                pthread_mutex_unlock(&sync_log.mutex);
+                return;
+            }
+            sync_log.events = events;
+            sync_log.capacity = capacity;
+        }
+        sync_log.events[sync_log.n_events] = event;
+        sync_log.n_events += 1;
+        pthread_mutex_unlock(&sync_log.mutex);
+        return;
+    }
+    if (sync_log.mode != SYNC_REPLAY) {
+        return;
+    }
+
+    pthread_mutex_lock(&sync_log.mutex);
+    sync_log.n_woken = 0;
+    if (!sync_log.diverged) {
+        // same actor, different outcome: the schedule can't be forced any further
+        // whether the actor had to sleep before its step is up to timing, not the schedule
+        struct sync_event *expected = &sync_log.events[sync_log.head];
+        if (expected->partner != event.partner || expected->tree != event.tree
+                || expected->level != event.level
+                || (expected->kind & ~SYNC_WOKEN) != (event.kind & ~SYNC_WOKEN)) {
+            printf("sync: diverged at event#%lu, actor#%u did something else\n",
+                sync_log.head, actor);
+            sync_log.diverged = 1;
+        } else {
+            sync_log.head += 1;
+        }
+        pthread_cond_broadcast(&sync_log.cond);
+    }
+    pthread_mutex_unlock(&sync_log.mutex);
+}
+
+/* the gnome waiting longest on a cond, SYNC_NOBODY if none */
+/* the caller holds the cond's mutex */
+unsigned sync_oldest_waiter(pthread_cond_t *cond) {
+    unsigned oldest = SYNC_NOBODY;
+    unsigned long long oldest_since = 0;
+    for (unsigned i = 0; i < sync_log.n_gnomes; i++) {
+        if (__atomic_load_n(&sync_log.waiting_on[i], __ATOMIC_RELAXED) != cond) {
+            continue;
+        }
+        unsigned long long since = __atomic_load_n(&sync_log.waiting_since[i], __ATOMIC_RELAXED);
+        if (oldest == SYNC_NOBODY || since < oldest_since) {
+            oldest = i;
+            oldest_since = since;
+        }
+    }
+    return oldest;
+}
+
+/* waits on a cond of a tree until a sync_signal or a sync_broadcast picks the gnome */
+/* the caller holds the cond's mutex and has ended its step */
+void sync_wait(unsigned gnome_id, pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    if (sync_log.mode == SYNC_FREE) {
+        pthread_cond_wait(cond, mutex);
+        return;
+    }
+
+    unsigned long long since = __atomic_add_fetch(&sync_log.n_waits, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&sync_log.waiting_since[gnome_id], since, __ATOMIC_RELAXED);
+    __atomic_store_n(&sync_log.waiting_on[gnome_id], cond, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&sync_log.waiting_on[gnome_id], __ATOMIC_RELAXED) == cond) {
+        pthread_cond_wait(cond, mutex);
+    }
+}
+
+/* wakes a single gnome waiting on a cond of a tree, the caller holds the cond's mutex */
+/* and is taking a step. When recording, the gnome waiting longest is woken and logged */
+/* with the step, when replaying, the one the log names, so the scheduler never picks */
+void sync_signal(pthread_cond_t *cond) {
+    if (sync_log.mode == SYNC_FREE) {
+        pthread_cond_signal(cond);
+        return;
+    }
+
+    unsigned woken = sync_oldest_waiter(cond);
+    if (sync_log.mode == SYNC_RECORD) {
+        if (sync_log.n_woken < 2) {
+            sync_log.woken[sync_log.n_woken++] = woken;
+        }
+    } else {
+        pthread_mutex_lock(&sync_log.mutex);
+        if (!sync_log.diverged && sync_log.n_woken < 2) {
+            unsigned expected = sync_log.events[sync_log.head].woken[sync_log.n_woken++];
+            if (expected != SYNC_NOBODY && expected < sync_log.n_gnomes
+                    && __atomic_load_n(&sync_log.waiting_on[expected], __ATOMIC_RELAXED) == cond) {
+                woken = expected;
+            } else if (expected != woken) {
+                printf("sync: diverged at event#%lu, actor#%u woke somebody else\n",
+                    sync_log.head, sync_log.events[sync_log.head].actor);
+                sync_log.diverged = 1;
+                pthread_cond_broadcast(&sync_log.cond);
+            }
+        }
+        pthread_mutex_unlock(&sync_log.mutex);
+    }
+
+    if (woken != SYNC_NOBODY) {
+        __atomic_store_n(&sync_log.waiting_on[woken], (pthread_cond_t *)0, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(cond);
+    }
+}
+
+/* wakes every gnome waiting on a cond of a tree, the caller holds the cond's mutex */
+void sync_broadcast(pthread_cond_t *cond) {
+    if (sync_log.mode != SYNC_FREE) {
+        for (size_t i = 0; i < sync_log.n_gnomes; i++) {
+            if (__atomic_load_n(&sync_log.waiting_on[i], __ATOMIC_RELAXED) == cond) {
+                __atomic_store_n(&sync_log.waiting_on[i], (pthread_cond_t *)0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_cond_broadcast(cond);
+}
+
+// call this every time to increment the tree's counter
+void ornament_hanged(struct xmas_tree *tree) {
+    pthread_mutex_lock(&tree->ornaments_mutex);
+    printf("tree#%u: ornament#%llu hanged\n", tree->id, tree->ornaments_cur);
+    tree->ornaments_cur += 1;
+    unsigned char all_hanged = tree->ornaments_cur == tree->ornaments_max;
+    if (all_hanged) {
+        clock_gettime(CLOCK_MONOTONIC, &tree->completed_at);
+    }
+    pthread_mutex_unlock(&tree->ornaments_mutex);
+
+    if (all_hanged) {
+        finish_xmas_tree(tree);
+    }
+}
+
+long go_up_the_tree(struct xmas_tree *tree, long level, unsigned gnome_id) {
+    if (level == tree->n_levels - 1) {
+        printf("tree#%u: gnome#%u stays at level#%ld", tree->id, gnome_id, level);
+        return level;
+    }
+
+    long *next_down_id = &tree->levels[level + 1].next_down_id;
+    pthread_mutex_t *go_down_mutex = &tree->levels[level + 1].go_down_mutex;
+    pthread_cond_t *go_down_cond = &tree->levels[level + 1].go_down_cond;
+
+    long *next_up_id;
+    pthread_mutex_t *go_up_mutex;
+    pthread_cond_t *go_up_cond;
+    if (level == -1) {
+        next_up_id = &tree->next_enter_id;
+        go_up_mutex = &tree->entrance_mutex;
+        go_up_cond = &tree->entrance_cond;
+    } else {
+        next_up_id = &tree->levels[level].next_up_id;
+        go_up_mutex = &tree->levels[level].go_up_mutex;
+        go_up_cond = &tree->levels[level].go_up_cond;
+    }
+
+    // SYNC_WOKEN once the gnome has been waiting on a cond
+    unsigned woken = 0;
+
+    sync_enter(gnome_id);
+    while (tree->levels[level + 1].n_gnomes_current == tree->levels[level + 1].gnome_cap) {
+        printf("tree#%u: gnome#%u is waiting to go up to level#%ld\n", tree->id, gnome_id, level + 1);
+
+        pthread_mutex_lock(go_up_mutex);
+        long up_id = *next_up_id; 
+        pthread_mutex_unlock(go_up_mutex);
+        pthread_mutex_lock(go_down_mutex);
+        long down_id = *next_down_id;
+        pthread_mutex_unlock(go_down_mutex);
+
+        // if somebody's waiting on the upper level, swap
+        if (up_id == -1 && down_id != -1) {
+            pthread_mutex_lock(go_up_mutex);
+            *next_up_id = gnome_id;
+            pthread_mutex_unlock(go_up_mutex);
+
+            pthread_mutex_lock(go_down_mutex);
+            sync_broadcast(go_down_cond);
+            pthread_mutex_unlock(go_down_mutex);
+            sync_leave(gnome_id, SYNC_SWAP_INIT_UP | woken, down_id, tree->id, level);
+
+            printf("tree#%u: gnome#%u initiates a swap up to level#%ld\n", tree->id, gnome_id, level + 1);
+            return level + 1;
+        }
+
+        // if next_up_id is unset, set it to your id (occupy the queue)
+        unsigned kind = SYNC_WAIT_UP;
+        if (up_id == -1) {
+            pthread_mutex_lock(go_up_mutex);
+            *next_up_id = (long)gnome_id;
+            up_id = (long)gnome_id;
+            pthread_mutex_unlock(go_up_mutex);
+            kind = SYNC_CLAIM_UP;
+        }
+
+        if (up_id != (long)gnome_id || down_id == -1) {
+            pthread_mutex_lock(go_up_mutex);
+            sync_leave(gnome_id, kind | woken, SYNC_NOBODY, tree->id, level);
+            sync_wait(gnome_id, go_up_cond, go_up_mutex);
+            pthread_mutex_unlock(go_up_mutex);
+            woken = SYNC_WOKEN;
+            sync_enter(gnome_id);
+            continue;
+        }
+
+        // if this was reached, it means that the upper level wants to swap
+        pthread_mutex_lock(go_up_mutex);
+        pthread_mutex_lock(go_down_mutex);
+        *next_up_id = -1;
+        *next_down_id = -1;
+        sync_broadcast(go_up_cond);
+        sync_broadcast(go_down_cond);
+        pthread_mutex_unlock(go_down_mutex);
+        pthread_mutex_unlock(go_up_mutex);
+        sync_leave(gnome_id, SYNC_SWAP_FOLLOW_UP | woken, down_id, tree->id, level);
+
+        printf("tree#%u: gnome#%u follows up on a swap up to level #%lu\n", tree->id, gnome_id, level + 1);
+        return level + 1;
+    }
+
+    // if this was reached, it means there's a free space on the upper level
+
+    pthread_mutex_lock(go_up_mutex);
     if (*next_up_id == gnome_id) {
         *next_up_id = -1;
     }
     pthread_mutex_unlock(go_up_mutex);
 
     // switch the level
-    pthread_mutex_lock(&tree.levels[level + 1].n_gnomes_mutex);
-    tree.levels[level + 1].n_gnomes_current += 1;
+    pthread_mutex_lock(&tree->levels[level + 1].n_gnomes_mutex);
+    tree->levels[level + 1].n_gnomes_current += 1;
     if (level >= 0) {
-        pthread_mutex_lock(&tree.levels[level].n_gnomes_mutex);
-        tree.levels[level].n_gnomes_current -= 1;
-        pthread_mutex_unlock(&tree.levels[level].n_gnomes_mutex);
+        pthread_mutex_lock(&tree->levels[level].n_gnomes_mutex);
+        tree->levels[level].n_gnomes_current -= 1;
+        pthread_mutex_unlock(&tree->levels[level].n_gnomes_mutex);
     }
-    pthread_mutex_unlock(&tree.levels[level + 1].n_gnomes_mutex);
+    pthread_mutex_unlock(&tree->levels[level + 1].n_gnomes_mutex);
 
     // signal to those waiting for a free space on the current level
-    pthread_cond_signal(go_down_cond);
+    pthread_mutex_lock(go_down_mutex);
+    sync_signal(go_down_cond);
+    pthread_mutex_unlock(go_down_mutex);
     if (level > 0) {
-        pthread_cond_signal(&tree.levels[level - 1].go_up_cond);
+        pthread_mutex_lock(&tree->levels[level - 1].go_up_mutex);
+        sync_signal(&tree->levels[level - 1].go_up_cond);
+        pthread_mutex_unlock(&tree->levels[level - 1].go_up_mutex);
     }
+    sync_leave(gnome_id, SYNC_MOVE_UP | woken, SYNC_NOBODY, tree->id, level);
 
-    printf("gnome#%u moves up to level#%ld\n", gnome_id, level + 1);
+    printf("tree#%u: gnome#%u moves up to level#%ld\n", tree->id, gnome_id, level + 1);
     return level + 1;
 }
 
-long go_down_the_tree(long level, unsigned gnome_id) {
+long go_down_the_tree(struct xmas_tree *tree, long level, unsigned gnome_id) {
     if (level < 0) {
-        printf("gnome#%u stays at the ground floor\n", gnome_id);
+        printf("tree#%u: gnome#%u stays at the ground floor\n", tree->id, gnome_id);
         return -1;
     }
 
     if (level == 0) {
-        pthread_mutex_lock(&tree.levels[level].n_gnomes_mutex);
-        tree.levels[level].n_gnomes_current -= 1;
-        pthread_mutex_unlock(&tree.levels[level].n_gnomes_mutex);
-        if (tree.n_levels > 1) {
-            pthread_cond_broadcast(&tree.levels[1].go_down_cond);
+        sync_enter(gnome_id);
+        pthread_mutex_lock(&tree->levels[level].n_gnomes_mutex);
+        tree->levels[level].n_gnomes_current -= 1;
+        pthread_mutex_unlock(&tree->levels[level].n_gnomes_mutex);
+        if (tree->n_levels > 1) {
+            pthread_mutex_lock(&tree->levels[1].go_down_mutex);
+            sync_broadcast(&tree->levels[1].go_down_cond);
+            pthread_mutex_unlock(&tree->levels[1].go_down_mutex);
         }
-        pthread_cond_broadcast(&tree.entrance_cond);
+        pthread_mutex_lock(&tree->entrance_mutex);
+        sync_broadcast(&tree->entrance_cond);
+        pthread_mutex_unlock(&tree->entrance_mutex);
+        sync_leave(gnome_id, SYNC_MOVE_DOWN, SYNC_NOBODY, tree->id, level);
 
-        printf("gnome#%u moves down to the ground floor\n", gnome_id);
+        printf("tree#%u: gnome#%u moves down to the ground floor\n", tree->id, gnome_id);
         return -1;
     }
 
-    long *next_down_id = &tree.levels[level].next_down_id;
-    pthread_mutex_t *go_down_mutex = &tree.levels[level].go_down_mutex;
-    pthread_cond_t *go_down_cond = &tree.levels[level].go_down_cond;
+    long *next_down_id = &tree->levels[level].next_down_id;
+    pthread_mutex_t *go_down_mutex = &tree->levels[level].go_down_mutex;
+    pthread_cond_t *go_down_cond = &tree->levels[level].go_down_cond;
 
-    long *next_up_id = &tree.levels[level - 1].next_up_id;
-    pthread_mutex_t *go_up_mutex = &tree.levels[level - 1].go_up_mutex;
-    pthread_cond_t *go_up_cond = &tree.levels[level - 1].go_up_cond;
-    
-    while (tree.levels[level - 1].n_gnomes_current == tree.levels[level - 1].gnome_cap) {
-        printf("gnome#%u is waiting to go down to level#%ld\n", gnome_id, level - 1);
+    long *next_up_id = &tree->levels[level - 1].next_up_id;
+    pthread_mutex_t *go_up_mutex = &tree->levels[level - 1].go_up_mutex;
+    pthread_cond_t *go_up_cond = &tree->levels[level - 1].go_up_cond;
+
+    // SYNC_WOKEN once the gnome has been waiting on a cond
+    unsigned woken = 0;
+
+    sync_enter(gnome_id);
+    while (tree->levels[level - 1].n_gnomes_current == tree->levels[level - 1].gnome_cap) {
+        printf("tree#%u: gnome#%u is waiting to go down to level#%ld\n", tree->id, gnome_id, level - 1);
 
         pthread_mutex_lock(go_up_mutex);
         long up_id = *next_up_id; 
@@ -455,24 +1526,32 @@ long go_down_the_tree(long level, unsigned gnome_id) {
             *next_down_id = gnome_id;
             pthread_mutex_unlock(go_down_mutex);
             
-            pthread_cond_broadcast(go_up_cond);
+            pthread_mutex_lock(go_up_mutex);
+            sync_broadcast(go_up_cond);
+            pthread_mutex_unlock(go_up_mutex);
+            sync_leave(gnome_id, SYNC_SWAP_INIT_DOWN | woken, up_id, tree->id, level);
 
-            printf("gnome#%u initiates a swap down to level#%ld\n", gnome_id, level - 1);
+            printf("tree#%u: gnome#%u initiates a swap down to level#%ld\n", tree->id, gnome_id, level - 1);
             return level - 1;
         }
 
         // if next_down_id is unset, set it to your id (occupy the queue)
+        unsigned kind = SYNC_WAIT_DOWN;
         if (down_id == -1) {
             pthread_mutex_lock(go_down_mutex);
             *next_down_id = (long)gnome_id;
             down_id = (long)gnome_id;
             pthread_mutex_unlock(go_down_mutex);
+            kind = SYNC_CLAIM_DOWN;
         }
 
         if (down_id != (long)gnome_id || up_id == -1) {
             pthread_mutex_lock(go_down_mutex);
-            pthread_cond_wait(go_down_cond, go_down_mutex);
+            sync_leave(gnome_id, kind | woken, SYNC_NOBODY, tree->id, level);
+            sync_wait(gnome_id, go_down_cond, go_down_mutex);
             pthread_mutex_unlock(go_down_mutex);
+            woken = SYNC_WOKEN;
+            sync_enter(gnome_id);
             continue;
         }
 
@@ -481,12 +1560,13 @@ long go_down_the_tree(long level, unsigned gnome_id) {
         pthread_mutex_lock(go_down_mutex);
         *next_up_id = -1;
         *next_down_id = -1;
-        pthread_cond_broadcast(go_up_cond);
-        pthread_cond_broadcast(go_down_cond);
+        sync_broadcast(go_up_cond);
+        sync_broadcast(go_down_cond);
         pthread_mutex_unlock(go_down_mutex);
         pthread_mutex_unlock(go_up_mutex);
+        sync_leave(gnome_id, SYNC_SWAP_FOLLOW_DOWN | woken, up_id, tree->id, level);
 
-        printf("gnome#%u follows up on a swap down to level #%lu\n", gnome_id, level - 1);
+        printf("tree#%u: gnome#%u follows up on a swap down to level #%lu\n", tree->id, gnome_id, level - 1);
         return level - 1;
     }
 
@@ -499,104 +1579,207 @@ long go_down_the_tree(long level, unsigned gnome_id) {
     pthread_mutex_unlock(go_down_mutex);
 
     // switch the level
-    pthread_mutex_lock(&tree.levels[level - 1].n_gnomes_mutex);
-    pthread_mutex_lock(&tree.levels[level].n_gnomes_mutex);
-    tree.levels[level - 1].n_gnomes_current += 1;
-    tree.levels[level].n_gnomes_current -= 1;
-    pthread_mutex_unlock(&tree.levels[level].n_gnomes_mutex);
-    pthread_mutex_unlock(&tree.levels[level - 1].n_gnomes_mutex);
+    pthread_mutex_lock(&tree->levels[level - 1].n_gnomes_mutex);
+    pthread_mutex_lock(&tree->levels[level].n_gnomes_mutex);
+    tree->levels[level - 1].n_gnomes_current += 1;
+    tree->levels[level].n_gnomes_current -= 1;
+    pthread_mutex_unlock(&tree->levels[level].n_gnomes_mutex);
+    pthread_mutex_unlock(&tree->levels[level - 1].n_gnomes_mutex);
 
     // signal to those waiting for a free space on the current level
-    pthread_cond_signal(go_up_cond);
-    pthread_cond_signal(&tree.levels[level + 1].go_down_cond);
+    pthread_mutex_lock(go_up_mutex);
+    sync_signal(go_up_cond);
+    pthread_mutex_unlock(go_up_mutex);
+    if (level + 1 < tree->n_levels) {
+        pthread_mutex_lock(&tree->levels[level + 1].go_down_mutex);
+        sync_signal(&tree->levels[level + 1].go_down_cond);
+        pthread_mutex_unlock(&tree->levels[level + 1].go_down_mutex);
+    }
+    sync_leave(gnome_id, SYNC_MOVE_DOWN | woken, SYNC_NOBODY, tree->id, level);
 
-    printf("gnome#%u moves down to level#%ld\n", gnome_id, level - 1);
+    printf("tree#%u: gnome#%u moves down to level#%ld\n", tree->id, gnome_id, level - 1);
     return level - 1;
 }
 
 // returns 0 on success, -1 on failure
-int hang_ornament(unsigned level_id, unsigned gnome_id) {
-    pthread_mutex_lock(&tree.levels[level_id].n_ornaments_mutex);
+int hang_ornament(struct xmas_tree *tree, unsigned level_id, unsigned gnome_id) {
+    sync_enter(gnome_id);
+    pthread_mutex_lock(&tree->levels[level_id].n_ornaments_mutex);
  
     unsigned ornament_id = 
-        tree.levels[level_id].n_ornaments_current +
-        tree.levels[level_id].n_ornaments_pending;
+        tree->levels[level_id].n_ornaments_current +
+        tree->levels[level_id].n_ornaments_pending;
 
     // if there still are ornaments to hang...
-    if (ornament_id < tree.levels[level_id].ornament_cap) {
-        tree.levels[level_id].n_ornaments_pending += 1;
-        pthread_mutex_unlock(&tree.levels[level_id].n_ornaments_mutex);
+    if (ornament_id < tree->levels[level_id].ornament_cap) {
+        tree->levels[level_id].n_ornaments_pending += 1;
+        pthread_mutex_unlock(&tree->levels[level_id].n_ornaments_mutex);
+        sync_leave(gnome_id, SYNC_HANG_START, SYNC_NOBODY, tree->id, level_id);
 
-        printf("gnome#%u started hanging an ornament#%u on level#%u\n",
-                gnome_id, ornament_id, level_id);
+        printf("tree#%u: gnome#%u started hanging an ornament#%u on level#%u\n",
+                tree->id, gnome_id, ornament_id, level_id);
         usleep(installation_time);
-        printf("gnome#%u finished hanging an ornament#%u on level#%u\n",
-                gnome_id, ornament_id, level_id);
+        printf("tree#%u: gnome#%u finished hanging an ornament#%u on level#%u\n",
+                tree->id, gnome_id, ornament_id, level_id);
 
-        pthread_mutex_lock(&tree.levels[level_id].n_ornaments_mutex);
-        tree.levels[level_id].n_ornaments_pending -= 1;
-        tree.levels[level_id].n_ornaments_current += 1;
-        pthread_mutex_unlock(&tree.levels[level_id].n_ornaments_mutex);
+        sync_enter(gnome_id);
+        pthread_mutex_lock(&tree->levels[level_id].n_ornaments_mutex);
+        tree->levels[level_id].n_ornaments_pending -= 1;
+        tree->levels[level_id].n_ornaments_current += 1;
+        pthread_mutex_unlock(&tree->levels[level_id].n_ornaments_mutex);
         
-        // increment the global counter
-        pthread_t th_inc_orn;
-        pthread_create(&th_inc_orn, NULL, ornament_hanged, NULL);
-        pthread_detach(th_inc_orn);
+        // increment the tree's counter
+        ornament_hanged(tree);
+        sync_leave(gnome_id, SYNC_HANG_DONE, SYNC_NOBODY, tree->id, level_id);
 
         return 0;
     }
-    pthread_mutex_unlock(&tree.levels[level_id].n_ornaments_mutex);
+    pthread_mutex_unlock(&tree->levels[level_id].n_ornaments_mutex);
+    sync_leave(gnome_id, SYNC_HANG_FULL, SYNC_NOBODY, tree->id, level_id);
     return -1;
 }
 
-// this function returning means the gnome has picked up an ornament
-void await_ornament(unsigned gnome_id) {
-    pthread_mutex_lock(&delivery.n_ornaments_mutex);
-    while (delivery.n_ornaments_current == 0) {
-        printf("gnome#%u is waiting for an ornament\n", gnome_id);
-        pthread_cond_wait(&delivery.n_ornaments_cond, &delivery.n_ornaments_mutex);
+// tries to take an ornament from the delivery of a tree that is not finished yet
+// the home tree is preferred, otherwise the gnome steals from the most loaded one
+// returns the id of the tree the ornament belongs to, -1 if there's none to take
+long take_ornament(unsigned gnome_id, unsigned home_id) {
+    while (1) {
+        struct xmas_tree *victim = (struct xmas_tree *)0;
+        unsigned victim_load = 0;
+
+        for (size_t i = 0; i < farm.n_trees; i++) {
+            struct xmas_tree *tree = &farm.trees[(home_id + i) % farm.n_trees];
+            pthread_mutex_lock(&tree->delivery.n_ornaments_mutex);
+            unsigned load = tree->delivery.closed ? 0 : tree->delivery.n_ornaments_current;
+            if (load > 0 && tree->id == home_id) {
+                tree->delivery.n_ornaments_current -= 1;
+                pthread_mutex_unlock(&tree->delivery.n_ornaments_mutex);
+                printf("tree#%u: gnome#%u picked up an ornament\n", tree->id, gnome_id);
+                return tree->id;
+            }
+            pthread_mutex_unlock(&tree->delivery.n_ornaments_mutex);
+            if (load > victim_load) {
+                victim = tree;
+                victim_load = load;
+            }
+        }
+
+        if (victim == (struct xmas_tree *)0) {
+            return -1;
+        }
+
+        // somebody else may have emptied it in the meantime, then look again
+        pthread_mutex_lock(&victim->delivery.n_ornaments_mutex);
+        if (!victim->delivery.closed && victim->delivery.n_ornaments_current > 0) {
+            victim->delivery.n_ornaments_current -= 1;
+            pthread_mutex_unlock(&victim->delivery.n_ornaments_mutex);
+
+            pthread_mutex_lock(&victim->ornaments_mutex);
+            victim->n_stolen += 1;
+            pthread_mutex_unlock(&victim->ornaments_mutex);
+
+            printf("tree#%u: gnome#%u stole an ornament from the delivery\n",
+                victim->id, gnome_id);
+            return victim->id;
+        }
+        pthread_mutex_unlock(&victim->delivery.n_ornaments_mutex);
+    }
+}
+
+// returns the id of the tree the gnome has picked up an ornament for,
+// -1 if every tree of the farm is finished
+long await_ornament(unsigned gnome_id, unsigned home_id) {
+    // SYNC_WOKEN once the gnome has been waiting for a delivery
+    unsigned woken = 0;
+
+    while (1) {
+        pthread_mutex_lock(&farm.idle_mutex);
+        unsigned long long seq = farm.delivery_seq;
+        pthread_mutex_unlock(&farm.idle_mutex);
+
+        sync_enter(gnome_id);
+        long tree_id = take_ornament(gnome_id, home_id);
+        sync_leave(gnome_id, (tree_id == -1 ? SYNC_PICK_NONE : SYNC_PICK_UP) | woken,
+            SYNC_NOBODY, tree_id, -1);
+        if (tree_id != -1) {
+            return tree_id;
+        }
+
+        // nothing to take, sleep until the next delivery or a finished tree
+        pthread_mutex_lock(&farm.idle_mutex);
+        if (farm.delivery_seq == seq && farm.n_trees_done < farm.n_trees) {
+            printf("gnome#%u is waiting for an ornament\n", gnome_id);
+        }
+        while (farm.delivery_seq == seq && farm.n_trees_done < farm.n_trees) {
+            pthread_cond_wait(&farm.idle_cond, &farm.idle_mutex);
+            woken = SYNC_WOKEN;
+        }
+        unsigned char all_done = farm.n_trees_done == farm.n_trees;
+        pthread_mutex_unlock(&farm.idle_mutex);
+
+        if (all_done) {
+            return -1;
+        }
     }
-    delivery.n_ornaments_current -= 1;
-    pthread_mutex_unlock(&delivery.n_ornaments_mutex);
-    printf("gnome#%u picked up an ornament\n", gnome_id);
-    return;
 }
 
 void *gnome(void *arg) {
     unsigned id = *((unsigned *)arg);
     printf("gnome#%u says hi\n", id);
 
+    // gnomes are spread evenly, they work elsewhere only when their home tree is idle
+    unsigned home_id = id % farm.n_trees;
+
     // 1 if currently carries an ornament, 0 otherwise
     unsigned char has_ornament = 0;
 
+    // the tree the gnome is working on, only changes on the ground floor
+    struct xmas_tree *tree = &farm.trees[home_id];
+
     // current level: -1 if ground
     long level = -1;
 
+    // where follow_gnome has put this gnome last, -1 if nowhere yet
+    long placed_band = -1;
+
+    // level accesses made from the node the level's memory is on and from elsewhere
+    unsigned long long n_local = 0;
+    unsigned long long n_remote = 0;
+
+    place_gnome(id, home_id);
+
     while (1) {
-        if (level == -1) {
-            // if all the ornaments are hanged, the gnome may rest
-            pthread_mutex_lock(&ornaments_mutex);
-            if (ornaments_cur == ornaments_max) {
-                printf("gnome #%u has finally rested under the christmas tree\n", id);
-                pthread_mutex_unlock(&ornaments_mutex);
-                break;
+        follow_gnome(tree, level, &placed_band);
+        if (level >= 0) {
+            int local = on_level_node(&tree->levels[level]);
+            if (local == 1) {
+                n_local += 1;
+            } else if (local == 0) {
+                n_remote += 1;
             }
-            pthread_mutex_unlock(&ornaments_mutex);
+        }
 
+        if (level == -1) {
             if (!has_ornament) {
-                await_ornament(id);
+                // if all the ornaments are hanged, the gnome may rest
+                long tree_id = await_ornament(id, home_id);
+                if (tree_id == -1) {
+                    printf("gnome #%u has finally rested under the christmas tree\n", id);
+                    break;
+                }
+                tree = &farm.trees[tree_id];
                 has_ornament = 1;
             }
-            level = go_up_the_tree(level, id);
+            level = go_up_the_tree(tree, level, id);
         } else if (level >= 0) {
             // if no ornament, go down
             if (!has_ornament) {
-                level = go_down_the_tree(level, id);
+                level = go_down_the_tree(tree, level, id);
                 continue;
             }
 
             // if successfully hanged an ornament:
-            if (hang_ornament(level, id) == 0) {
+            if (hang_ornament(tree, level, id) == 0) {
                 has_ornament = 0;
                 continue;
             }
@@ -604,72 +1787,2557 @@ void *gnome(void *arg) {
             // There is no space for another ornament on the current level.
             // If it's the top level, you can throw the ornament to the floor
             // as you've already checked every level so it's time to give up.
-            if (level == tree.n_levels - 1) {
+            if (level == tree->n_levels - 1) {
                 has_ornament = 0;
                 continue;
             }
             
             // Maybe there's still space on the upper levels...
-            level = go_up_the_tree(level, id);
+            level = go_up_the_tree(tree, level, id);
         } else {
             break;
         }
     }
 
+    add_locality(n_local, n_remote);
     return NULL;
 }
 
 void *santa(void *arg) {
+    struct xmas_tree *tree = (struct xmas_tree *)arg;
+    struct ornament_delivery *delivery = &tree->delivery;
+    unsigned actor = sync_log.n_gnomes + tree->id;
+
     while (1) {
-        pthread_mutex_lock(&delivery.n_ornaments_mutex);
-        printf("delivery: %u ornaments delivered for a total of %u\n",
-            delivery.ornaments_per_delivery,
-            delivery.n_ornaments_current + delivery.ornaments_per_delivery);
-        delivery.n_ornaments_current += delivery.ornaments_per_delivery;
-        pthread_mutex_unlock(&delivery.n_ornaments_mutex);
-        pthread_cond_broadcast(&delivery.n_ornaments_cond);
-        usleep(delivery.interval_microseconds);
-    }
-}
+        sync_enter(actor);
+        pthread_mutex_lock(&delivery->n_ornaments_mutex);
+        if (delivery->closed) {
+            pthread_mutex_unlock(&delivery->n_ornaments_mutex);
+            sync_leave(actor, SYNC_SANTA_LEAVE, SYNC_NOBODY, tree->id, -1);
+            break;
+        }
+        printf("tree#%u: delivery: %u ornaments delivered for a total of %u\n",
+            tree->id, delivery->ornaments_per_delivery,
+            delivery->n_ornaments_current + delivery->ornaments_per_delivery);
+        delivery->n_ornaments_current += delivery->ornaments_per_delivery;
+        pthread_mutex_unlock(&delivery->n_ornaments_mutex);
+        notify_idle_gnomes(0);
+        sync_leave(actor, SYNC_DELIVER, SYNC_NOBODY, tree->id, -1);
 
-int main(int argc, char **argv) {
-    if (argc < 6) {
-        USAGE_ERR;
-    }
+        pthread_mutex_lock(&delivery->n_ornaments_mutex);
 
-    char *endptr;
+        // sleep until the next delivery, unless the delivery gets closed first
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += delivery->interval_microseconds / 1000000;
+        deadline.tv_nsec += (delivery->interval_microseconds % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!delivery->closed) {
+            int err = pthread_cond_timedwait(
+                &delivery->n_ornaments_cond, &delivery->n_ornaments_mutex, &deadline);
+            if (err == ETIMEDOUT) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&delivery->n_ornaments_mutex);
+    }
+
+    printf("tree#%u: delivery: santa goes home\n", tree->id);
+    return NULL;
+}
+
+/* sets when the farm got finished, the last of its trees */
+void complete_xmas_farm() {
+    farm.completed_at = farm.started_at;
+    for (size_t i = 0; i < farm.n_trees; i++) {
+        if (seconds_between(&farm.completed_at, &farm.trees[i].completed_at) > 0) {
+            farm.completed_at = farm.trees[i].completed_at;
+        }
+    }
+}
+
+/* prints per-tree and whole-farm completion metrics */
+void report_xmas_farm() {
+    unsigned long long farm_ornaments = 0;
+
+    printf("\nfarm report:\n");
+    for (size_t i = 0; i < farm.n_trees; i++) {
+        struct xmas_tree *tree = &farm.trees[i];
+        double seconds = seconds_between(&farm.started_at, &tree->completed_at);
+        printf(
+            "  tree: %lu\n"
+            "    ornaments: %llu\n"
+            "    stolen: %llu\n"
+            "    completion_time: %.3fs\n"
+            "    ornaments_per_second: %.3f\n",
+            i, tree->ornaments_cur, tree->n_stolen, seconds,
+            seconds > 0 ? tree->ornaments_cur / seconds : 0.0
+        );
+        farm_ornaments += tree->ornaments_cur;
+    }
+
+    double seconds = seconds_between(&farm.started_at, &farm.completed_at);
+    unsigned long long n_accesses = affinity.n_local + affinity.n_remote;
+    printf(
+        "  farm:\n"
+        "    ornaments: %llu\n"
+        "    completion_time: %.3fs\n"
+        "    ornaments_per_second: %.3f\n"
+        "    locality: %.1f%% (%llu of %llu level accesses on the level's node)\n",
+        farm_ornaments, seconds,
+        seconds > 0 ? farm_ornaments / seconds : 0.0,
+        n_accesses > 0 ? 100.0 * affinity.n_local / n_accesses : 100.0,
+        affinity.n_local, n_accesses
+    );
+
+    // a diverged replay is a different run, possibly one that stood still for a while
+    if (sync_log.mode == SYNC_REPLAY && sync_log.diverged) {
+        printf("    replay: diverged, the times above are not comparable and include "
+            "%.3fs waiting for steps that never came\n", sync_log.stalled_seconds);
+    }
+}
+
+/* kills the first n_trees trees of the farm along with their deliveries */
+void kill_xmas_trees(unsigned n_trees) {
+    for (size_t i = 0; i < n_trees; i++) {
+        kill_ornament_delivery(&farm.trees[i].delivery);
+        kill_xmas_tree(&farm.trees[i]);
+    }
+}
+
+/* everything the command line describes, enough to run a farm */
+struct xmas_config {
+    unsigned n_trees;
+    enum affinity_mode affinity_mode;
+    unsigned n_gnomes;
+    useconds_t installation_time;
+    unsigned ornaments_per_delivery;
+    useconds_t delivery_interval;
+    unsigned n_levels;
+    unsigned *gnome_cap_list;
+    unsigned *ornament_cap_list;
+
+    /* at most one of them is set */
+    const char *record_path;
+    const char *replay_path;
+};
+
+/* sets up the farm described by the config, runs it to completion and tears it down */
+/* returns 0 on success, -1 on failure */
+int run_xmas_farm(const struct xmas_config *config) {
+    installation_time = config->installation_time;
+
+    if (init_affinity(config->affinity_mode) == -1) {
+        fprintf(stderr, "ERROR: failed to initialize the affinity static variable\n");
+        return -1;
+    }
+
+    if (init_xmas_farm(config->n_trees) == -1) {
+        fprintf(stderr, "ERROR: failed to initialize the farm static variable\n");
+        kill_affinity();
+        return -1;
+    }
+
+    // nobody waits for a turn longer than an installation or a delivery interval takes
+    enum sync_mode sync_mode = config->record_path != (const char *)0 ? SYNC_RECORD
+        : config->replay_path != (const char *)0 ? SYNC_REPLAY : SYNC_FREE;
+    useconds_t patience = config->installation_time > config->delivery_interval
+        ? config->installation_time : config->delivery_interval;
+    if (init_sync_log(sync_mode, config->replay_path, config->n_gnomes,
+            config->n_trees, config->n_levels, 2 * patience + 1000000) == -1) {
+        fprintf(stderr, "ERROR: failed to initialize the sync_log static variable\n");
+        kill_xmas_farm();
+        kill_affinity();
+        return -1;
+    }
+
+    for (size_t i = 0; i < farm.n_trees; i++) {
+        struct xmas_tree *tree = &farm.trees[i];
+        place_tree(i);
+
+        if (init_ornament_delivery(&tree->delivery,
+                config->ornaments_per_delivery, config->delivery_interval) == -1) {
+            fprintf(stderr, "ERROR: failed to initialize the delivery of trees[%lu]\n", i);
+            kill_xmas_trees(i);
+            kill_xmas_farm();
+            kill_sync_log();
+            kill_affinity();
+            return -1;
+        }
+
+        if (init_xmas_tree(tree, i, config->n_gnomes, config->n_levels,
+                config->gnome_cap_list, config->ornament_cap_list) == -1) {
+            fprintf(stderr, "ERROR: failed to initialize trees[%lu]\n", i);
+            kill_ornament_delivery(&tree->delivery);
+            kill_xmas_trees(i);
+            kill_xmas_farm();
+            kill_sync_log();
+            kill_affinity();
+            return -1;
+        }
+    }
+
+    unplace_main_thread();
+
+    struct xmas_tree *tree = &farm.trees[0];
+    printf("affinity: %s\n", affinity_modes[affinity.mode]);
+    printf("  n_cpus: %u\n", affinity.n_cpus);
+    printf("  n_nodes: %u\n", affinity.n_nodes);
+    printf("n_trees: %u\n", farm.n_trees);
+    printf("n_gnomes: %u\n", config->n_gnomes);
+    printf("ornaments_max: %llu\n", tree->ornaments_max);
+    printf("installation_time %u\n", installation_time);
+    printf("ornaments_per_delivery: %u\n", tree->delivery.ornaments_per_delivery);
+    printf("delivey_interval: %u\n", tree->delivery.interval_microseconds);
+    printf("n_levels: %u\n", tree->n_levels);
+    for (size_t i = 0; i < tree->n_levels; i++) {
+        printf(
+            "  level: %lu\n"
+            "    gnome_cap: %u\n"
+            "    ornament_cap: %u\n",
+            i, tree->levels[i].gnome_cap, tree->levels[i].ornament_cap
+        );
+    }
+
+    pthread_t *gnome_threads = (pthread_t *)malloc(sizeof(pthread_t) * config->n_gnomes);
+    if (gnome_threads == (pthread_t *)0) {
+        fprintf(stderr, "ERROR: failed to allocate memory for thread handles\n");
+        kill_xmas_trees(farm.n_trees);
+        kill_xmas_farm();
+        kill_sync_log();
+        kill_affinity();
+        return -1;
+    }
+    
+    unsigned *gnome_ids = (unsigned *)malloc(sizeof(unsigned) * config->n_gnomes);
+    if (gnome_ids == (unsigned *)0) {
+        fprintf(stderr, "ERROR: failed to allocate memory for gnome_ids\n");
+        free(gnome_threads);
+        kill_xmas_trees(farm.n_trees);
+        kill_xmas_farm();
+        kill_sync_log();
+        kill_affinity();
+        return -1;
+    }
+
+    pthread_t *santa_threads = (pthread_t *)malloc(sizeof(pthread_t) * farm.n_trees);
+    if (santa_threads == (pthread_t *)0) {
+        fprintf(stderr, "ERROR: failed to allocate memory for santa_threads\n");
+        free(gnome_threads);
+        free(gnome_ids);
+        kill_xmas_trees(farm.n_trees);
+        kill_xmas_farm();
+        kill_sync_log();
+        kill_affinity();
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &farm.started_at);
+
+    // nothing to hang, nothing to deliver
+    for (size_t i = 0; i < farm.n_trees; i++) {
+        if (farm.trees[i].ornaments_max == 0) {
+            farm.trees[i].completed_at = farm.started_at;
+            finish_xmas_tree(&farm.trees[i]);
+        }
+    }
+
+    // a thread that fails to start ends the run, the ones started still use the
+    // trees, so they are stopped and joined before anything is torn down
+    int result = 0;
+    size_t n_gnomes_started = 0;
+    for (; n_gnomes_started < config->n_gnomes; n_gnomes_started++) {
+        gnome_ids[n_gnomes_started] = (unsigned)n_gnomes_started;
+        if (pthread_create(&gnome_threads[n_gnomes_started], NULL, gnome,
+                &gnome_ids[n_gnomes_started]) != 0) {
+            fprintf(stderr, "ERROR: failed to init gnome_threads[%lu]\n", n_gnomes_started);
+            result = -1;
+            break;
+        }
+    }
+
+    // handle ornament delivery, one santa per tree
+    size_t n_santas_started = 0;
+    for (; result == 0 && n_santas_started < farm.n_trees; n_santas_started++) {
+        if (pthread_create(&santa_threads[n_santas_started], NULL, santa,
+                &farm.trees[n_santas_started]) != 0) {
+            fprintf(stderr, "ERROR: failed to init santa_threads[%lu]\n", n_santas_started);
+            result = -1;
+            break;
+        }
+    }
+
+    if (result == -1) {
+        abort_xmas_farm();
+    }
+
+    // wait for all the threads to complete
+    for (size_t i = 0; i < n_gnomes_started; i++) {
+        pthread_join(gnome_threads[i], NULL);
+        printf("gnome_threads[%lu] joined\n", i);
+    }
+
+    printf("all gnome_threads joined\n");
+
+    // every santa notices the closed delivery and leaves without waiting out the interval
+    for (size_t i = 0; i < n_santas_started; i++) {
+        pthread_join(santa_threads[i], NULL);
+    }
+    printf("all santa_threads joined, terminating\n");
+
+    if (result == -1) {
+        fprintf(stderr, "ERROR: the run was cut short, there is nothing to report\n");
+    } else {
+        complete_xmas_farm();
+        report_xmas_farm();
+
+        if (sync_log.mode == SYNC_RECORD) {
+            result = write_sync_log(config->record_path, farm.n_trees, config->n_levels);
+            if (result == 0) {
+                printf("sync: %lu events recorded to %s\n", sync_log.n_events, config->record_path);
+            }
+        } else if (sync_log.mode == SYNC_REPLAY) {
+            printf("sync: %lu of %lu recorded events replayed%s\n", sync_log.head, sync_log.n_events,
+                sync_log.diverged ? ", the rest of the run went its own way" : "");
+        }
+    }
+
+    free(gnome_threads);
+    free(gnome_ids);
+    free(santa_threads);
+    kill_xmas_trees(farm.n_trees);
+    kill_xmas_farm();
+    kill_sync_log();
+    kill_affinity();
+    return result;
+}
+
+/* the number of simulation runs an autotune may spend */
+#define AUTOTUNE_BUDGET 96
+
+/* candidates run this many times faster than real time */
+#define AUTOTUNE_TIME_SCALE 100
+
+/* a point of the search space, the rest of the config stays as given */
+struct autotune_candidate {
+    unsigned *gnome_cap_list;
+    unsigned *ornament_cap_list;
+    unsigned ornaments_per_delivery;
+    useconds_t delivery_interval;
+
+    /* real (unscaled) completion time of the farm as the run measured it, */
+    /* -1 if pruned, failed or not run yet */
+    double seconds;
+
+    /* scaled time from fork to reap, process setup and teardown included, */
+    /* only good for pruning */
+    double wall_seconds;
+};
+
+/* picks the batch size of a delivery, the interval follows so the delivery rate is kept */
+void autotune_delivery(
+    const struct xmas_config *base,
+    struct autotune_candidate *candidate,
+    unsigned ornaments_per_delivery
+) {
+    unsigned base_per_delivery = base->ornaments_per_delivery > 0 ? base->ornaments_per_delivery : 1;
+    candidate->ornaments_per_delivery = ornaments_per_delivery;
+    candidate->delivery_interval = (unsigned long long)base->delivery_interval
+        * ornaments_per_delivery / base_per_delivery;
+}
+
+/* draws a random valid candidate with the same number of ornaments per tree */
+void autotune_random(const struct xmas_config *base, struct autotune_candidate *candidate) {
+    unsigned n_levels = base->n_levels;
+
+    // distinct caps sorted in descending order always decrease going up
+    unsigned max_cap = base->n_gnomes > n_levels ? base->n_gnomes : n_levels;
+    for (size_t i = 0; i < n_levels; i++) {
+        unsigned cap;
+        unsigned char taken;
+        do {
+            cap = 1 + rand() % max_cap;
+            taken = 0;
+            for (size_t j = 0; j < i; j++) {
+                taken |= candidate->gnome_cap_list[j] == cap;
+            }
+        } while (taken);
+        size_t j = i;
+        while (j > 0 && candidate->gnome_cap_list[j - 1] < cap) {
+            candidate->gnome_cap_list[j] = candidate->gnome_cap_list[j - 1];
+            j -= 1;
+        }
+        candidate->gnome_cap_list[j] = cap;
+    }
+
+    unsigned long long n_ornaments = 0;
+    for (size_t i = 0; i < n_levels; i++) {
+        n_ornaments += base->ornament_cap_list[i];
+        candidate->ornament_cap_list[i] = 0;
+    }
+    for (unsigned long long i = 0; i < n_ornaments; i++) {
+        candidate->ornament_cap_list[rand() % n_levels] += 1;
+    }
+
+    unsigned max_batch = n_ornaments > 0 ? n_ornaments : 1;
+    unsigned batch = 1;
+    for (unsigned shift = rand() % 8; shift > 0 && batch * 2 <= max_batch; shift--) {
+        batch *= 2;
+    }
+    autotune_delivery(base, candidate, batch);
+    candidate->seconds = -1;
+    candidate->wall_seconds = -1;
+}
+
+/* derives a neighbour of a candidate: a cap one off, a few ornaments moved, */
+/* or the delivery batch doubled or halved */
+void autotune_mutate(
+    const struct xmas_config *base,
+    const struct autotune_candidate *from,
+    struct autotune_candidate *candidate
+) {
+    unsigned n_levels = base->n_levels;
+    for (size_t i = 0; i < n_levels; i++) {
+        candidate->gnome_cap_list[i] = from->gnome_cap_list[i];
+        candidate->ornament_cap_list[i] = from->ornament_cap_list[i];
+    }
+    candidate->ornaments_per_delivery = from->ornaments_per_delivery;
+    candidate->delivery_interval = from->delivery_interval;
+    candidate->seconds = -1;
+    candidate->wall_seconds = -1;
+
+    unsigned max_cap = base->n_gnomes > n_levels ? base->n_gnomes : n_levels;
+    size_t i = rand() % n_levels;
+    switch (rand() % 3) {
+    case 0: {
+        unsigned *caps = candidate->gnome_cap_list;
+        if (rand() % 2) {
+            if (caps[i] < max_cap && (i == 0 || caps[i] + 1 < caps[i - 1])) {
+                caps[i] += 1;
+            }
+        } else {
+            if (caps[i] > 1 && (i == n_levels - 1 || caps[i] - 1 > caps[i + 1])) {
+                caps[i] -= 1;
+            }
+        }
+        break;
+    }
+    case 1: {
+        size_t j = rand() % n_levels;
+        unsigned *caps = candidate->ornament_cap_list;
+        unsigned moved = 1 + rand() % (caps[i] / 2 + 1);
+        if (moved > caps[i]) {
+            moved = caps[i];
+        }
+        caps[i] -= moved;
+        caps[j] += moved;
+        break;
+    }
+    default: {
+        // batches beyond the ornaments of a tree are all the same
+        unsigned long long n_ornaments = 0;
+        for (size_t j = 0; j < n_levels; j++) {
+            n_ornaments += candidate->ornament_cap_list[j];
+        }
+        unsigned batch = candidate->ornaments_per_delivery;
+        batch = (rand() % 2 || batch == 1) && batch * 2 <= n_ornaments ? batch * 2 : batch / 2;
+        autotune_delivery(base, candidate, batch > 0 ? batch : 1);
+        break;
+    }
+    }
+}
+
+/* tells whether two candidates describe the same configuration */
+unsigned char autotune_same(
+    unsigned n_levels,
+    const struct autotune_candidate *a,
+    const struct autotune_candidate *b
+) {
+    if (a->ornaments_per_delivery != b->ornaments_per_delivery) {
+        return 0;
+    }
+    for (size_t i = 0; i < n_levels; i++) {
+        if (a->gnome_cap_list[i] != b->gnome_cap_list[i]
+                || a->ornament_cap_list[i] != b->ornament_cap_list[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* runs a candidate in a child process, time scaled and with the output discarded */
+/* the child stores the (scaled) completion time of its farm in `*seconds`, */
+/* which has to be shared with the parent */
+/* returns the pid of the child, -1 on failure */
+pid_t autotune_spawn(
+    const struct xmas_config *base,
+    const struct autotune_candidate *candidate,
+    double *seconds
+) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    if (freopen("/dev/null", "w", stdout) == (FILE *)0) {
+        exit(1);
+    }
+
+    struct xmas_config config = *base;
+    config.record_path = (const char *)0;
+    config.replay_path = (const char *)0;
+    config.gnome_cap_list = candidate->gnome_cap_list;
+    config.ornament_cap_list = candidate->ornament_cap_list;
+    config.ornaments_per_delivery = candidate->ornaments_per_delivery;
+    config.installation_time = base->installation_time / AUTOTUNE_TIME_SCALE;
+    config.delivery_interval = candidate->delivery_interval / AUTOTUNE_TIME_SCALE;
+    if (config.installation_time == 0) {
+        config.installation_time = 1;
+    }
+    if (config.delivery_interval == 0) {
+        config.delivery_interval = 1;
+    }
+    if (run_xmas_farm(&config) == -1) {
+        exit(1);
+    }
+    *seconds = seconds_between(&farm.started_at, &farm.completed_at);
+    exit(0);
+}
+
+/* runs the candidates n_jobs at a time, the best one is the one whose farm completes */
+/* first, and it has to beat `to_beat` seconds of scaled time (unless that's -1). A run */
+/* is killed as soon as its wall clock time is longer than the best one's so far */
+/* (or than `limit` seconds of scaled time while there's none) */
+/* returns the index of the best candidate, -1 if every run was pruned, failed or lost */
+long autotune_run(
+    const struct xmas_config *base,
+    struct autotune_candidate *candidates,
+    size_t n_candidates,
+    unsigned n_jobs,
+    double to_beat,
+    double limit,
+    unsigned *n_pruned
+) {
+    pid_t *pids = malloc(n_jobs * sizeof(pid_t));
+    size_t *running = malloc(n_jobs * sizeof(size_t));
+    struct timespec *started_at = malloc(n_jobs * sizeof(struct timespec));
+    if (pids == (pid_t *)0 || running == (size_t *)0 || started_at == (struct timespec *)0) {
+        free(pids);
+        free(running);
+        free(started_at);
+        fprintf(stderr, "autotune_run: failed to malloc the job table\n");
+        return -1;
+    }
+
+    // the completion times the children measured, a page shared with all of them
+    double *reported = mmap(NULL, n_jobs * sizeof(double),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (reported == MAP_FAILED) {
+        free(pids);
+        free(running);
+        free(started_at);
+        fprintf(stderr, "autotune_run: failed to mmap the reported times\n");
+        return -1;
+    }
+    for (size_t i = 0; i < n_jobs; i++) {
+        pids[i] = -1;
+    }
+
+    long best = -1;
+    size_t next = 0;
+    unsigned n_running = 0;
+    while (next < n_candidates || n_running > 0) {
+        for (size_t i = 0; i < n_jobs && next < n_candidates; i++) {
+            if (pids[i] != -1) {
+                continue;
+            }
+            reported[i] = -1;
+            clock_gettime(CLOCK_MONOTONIC, &started_at[i]);
+            pids[i] = autotune_spawn(base, &candidates[next], &reported[i]);
+            if (pids[i] == -1) {
+                fprintf(stderr, "autotune_run: failed to fork\n");
+                next += 1;
+                continue;
+            }
+            running[i] = next;
+            next += 1;
+            n_running += 1;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (size_t i = 0; i < n_jobs; i++) {
+            if (pids[i] == -1) {
+                continue;
+            }
+
+            int status;
+            double seconds = seconds_between(&started_at[i], &now);
+            if (waitpid(pids[i], &status, WNOHANG) == pids[i]) {
+                if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && reported[i] >= 0
+                        && (to_beat == -1 || reported[i] < to_beat)) {
+                    candidates[running[i]].seconds = reported[i] * AUTOTUNE_TIME_SCALE;
+                    candidates[running[i]].wall_seconds = seconds;
+                    to_beat = reported[i];
+                    limit = seconds;
+                    best = running[i];
+                }
+                pids[i] = -1;
+                n_running -= 1;
+            } else if (seconds > limit) {
+                // can't beat the best one anymore, or hangs
+                kill(pids[i], SIGKILL);
+                waitpid(pids[i], &status, 0);
+                *n_pruned += 1;
+                pids[i] = -1;
+                n_running -= 1;
+            }
+        }
+
+        usleep(1000);
+    }
+
+    munmap(reported, n_jobs * sizeof(double));
+    free(pids);
+    free(running);
+    free(started_at);
+    return best;
+}
+
+/* writes a candidate as a testcase file that run.sh accepts */
+/* returns 0 on success, -1 on failure */
+int autotune_write(
+    const struct xmas_config *base,
+    const struct autotune_candidate *candidate,
+    const char *path
+) {
+    FILE *file = fopen(path, "w");
+    if (file == (FILE *)0) {
+        fprintf(stderr, "autotune_write: failed to open %s\n", path);
+        return -1;
+    }
+
+    fprintf(file, "# autotuned, expected completion time %.3fs\n", candidate->seconds);
+    if (base->n_trees != 1) {
+        fprintf(file, "N_TREES=%u\n", base->n_trees);
+    }
+    if (base->affinity_mode != AFFINITY_NONE) {
+        fprintf(file, "AFFINITY=%s\n", affinity_modes[base->affinity_mode]);
+    }
+    fprintf(file, "N_GNOMES=%u\n", base->n_gnomes);
+    fprintf(file, "ORNAMENT_INSTALLATION_TIME_MICROSECONDS=%u\n", base->installation_time);
+    fprintf(file, "ORNAMENTS_PER_DELIVERY=%u\n", candidate->ornaments_per_delivery);
+    fprintf(file, "DELIVERY_INTERVAL_MICROSECONDS=%u\n", candidate->delivery_interval);
+    fprintf(file, "N_LEVELS=%u\n", base->n_levels);
+    fprintf(file, "GNOME_CAP='");
+    for (size_t i = 0; i < base->n_levels; i++) {
+        fprintf(file, i == 0 ? "%u" : " %u", candidate->gnome_cap_list[i]);
+    }
+    fprintf(file, "'\nORNAMENT_CAP='");
+    for (size_t i = 0; i < base->n_levels; i++) {
+        fprintf(file, i == 0 ? "%u" : " %u", candidate->ornament_cap_list[i]);
+    }
+    fprintf(file, "'\n");
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "autotune_write: failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* searches gnome caps, the split of ornaments between levels and the delivery batch */
+/* for the fastest completion, keeping the gnomes, levels, ornaments per tree and */
+/* the delivery rate as given; with those fixed, the fastest run also has the most */
+/* ornaments per second. Rounds of candidates run in parallel on every core: the */
+/* first round samples at random, later ones mostly mutate the best candidate so far */
+/* returns 0 on success, -1 on failure */
+int autotune(const struct xmas_config *base, const char *path) {
+    unsigned n_levels = base->n_levels;
+    long n_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_jobs < 1) {
+        n_jobs = 1;
+    }
+    size_t round_size = n_jobs > 4 ? n_jobs : 4;
+
+    struct autotune_candidate *candidates = malloc(AUTOTUNE_BUDGET * sizeof(struct autotune_candidate));
+    unsigned *caps = malloc(AUTOTUNE_BUDGET * 2 * n_levels * sizeof(unsigned));
+    if (candidates == (struct autotune_candidate *)0 || caps == (unsigned *)0) {
+        free(candidates);
+        free(caps);
+        fprintf(stderr, "autotune: failed to malloc the candidates\n");
+        return -1;
+    }
+    for (size_t i = 0; i < AUTOTUNE_BUDGET; i++) {
+        candidates[i].gnome_cap_list = &caps[2 * i * n_levels];
+        candidates[i].ornament_cap_list = &caps[(2 * i + 1) * n_levels];
+    }
+
+    srand(time(NULL) ^ getpid());
+
+    // the given configuration competes too
+    for (size_t i = 0; i < n_levels; i++) {
+        candidates[0].gnome_cap_list[i] = base->gnome_cap_list[i];
+        candidates[0].ornament_cap_list[i] = base->ornament_cap_list[i];
+    }
+    autotune_delivery(base, &candidates[0], base->ornaments_per_delivery);
+    candidates[0].seconds = -1;
+    candidates[0].wall_seconds = -1;
+
+    // until there's a best run, prune the ones far slower than the delivery alone takes
+    unsigned long long n_ornaments = 0;
+    for (size_t i = 0; i < n_levels; i++) {
+        n_ornaments += base->ornament_cap_list[i];
+    }
+    double delivery_seconds = (double)n_ornaments * base->delivery_interval
+        / (base->ornaments_per_delivery > 0 ? base->ornaments_per_delivery : 1) / 1e6;
+    double limit = (20 * (delivery_seconds + base->installation_time / 1e6)) / AUTOTUNE_TIME_SCALE + 1;
+
+    long best = -1;
+    unsigned n_pruned = 0;
+    size_t n_candidates = 1;
+    for (unsigned round = 0; n_candidates < AUTOTUNE_BUDGET; round++) {
+        size_t first = round == 0 ? 0 : n_candidates;
+        size_t last = first + round_size < AUTOTUNE_BUDGET ? first + round_size : AUTOTUNE_BUDGET;
+
+        for (size_t i = n_candidates; i < last; i++) {
+            // a few tries to come up with something new
+            for (unsigned attempt = 0; attempt < 100; attempt++) {
+                if (best == -1 || rand() % 4 == 0) {
+                    autotune_random(base, &candidates[i]);
+                } else {
+                    autotune_mutate(base, &candidates[best], &candidates[i]);
+                }
+                unsigned char seen = 0;
+                for (size_t j = 0; j < i && !seen; j++) {
+                    seen = autotune_same(n_levels, &candidates[i], &candidates[j]);
+                }
+                if (!seen) {
+                    break;
+                }
+            }
+        }
+        n_candidates = last;
+
+        double round_to_beat = best == -1 ? -1 : candidates[best].seconds / AUTOTUNE_TIME_SCALE;
+        double round_limit = best == -1 ? limit : candidates[best].wall_seconds;
+        long round_best = autotune_run(base, &candidates[first], last - first,
+            n_jobs, round_to_beat, round_limit, &n_pruned);
+        if (round_best != -1) {
+            best = first + round_best;
+        }
+
+        if (best == -1) {
+            printf("autotune: round#%u, no successful run yet\n", round);
+        } else {
+            printf("autotune: round#%u, best completion time %.3fs after %lu runs\n",
+                round, candidates[best].seconds, n_candidates);
+        }
+    }
+
+    if (best == -1) {
+        fprintf(stderr, "autotune: every run failed or hanged\n");
+        free(candidates);
+        free(caps);
+        return -1;
+    }
+
+    printf("autotune: %lu runs, %u pruned\n", n_candidates, n_pruned);
+    printf("autotune: best completion time %.3fs, %.3f ornaments per second per tree\n",
+        candidates[best].seconds, n_ornaments / candidates[best].seconds);
+    int result = autotune_write(base, &candidates[best], path);
+    if (result == 0) {
+        printf("autotune: written to %s\n", path);
+    }
+
+    free(candidates);
+    free(caps);
+    return result;
+}
+
+/* the explorer checks the level protocol of go_up_the_tree/go_down_the_tree */
+/* by visiting every state a tree can get into. Trees only share the ground */
+/* floor, so a single tree covers the protocol. Santa is taken to have always */
+/* delivered by the time a gnome looks: when a delivery comes only decides */
+/* when idle gnomes move on, and every order of the steps is tried anyway */
+
+/* how fine the steps of a gnome are */
+enum explore_grain {
+    /* a step of a record, as if every run was recorded */
+    EXPLORE_SYNC,
+
+    /* a critical section, an unlocked read counts as one too, so every race */
+    /* between reading the queues and acting on them is in */
+    EXPLORE_LOCK,
+};
+
+static const char *explore_grains[] = { "sync", "lock" };
+
+/* the largest model the explorer takes, ids and counters fit an int8_t */
+#define EXPLORE_MAX_GNOMES 100
+#define EXPLORE_MAX_LEVELS 100
+#define EXPLORE_MAX_ORNAMENTS 127
+
+/* the share of the available memory the states and the hash table may take */
+#define EXPLORE_MEMORY_SHARE 0.75
+
+/* the hash table has this many slots per state kept */
+#define EXPLORE_SLOTS_PER_STATE 1.25
+
+/* renamings of the gnomes tried at most to find the canonical form of a state, */
+/* beyond that some states that only differ in names are kept apart */
+#define EXPLORE_MAX_RENAMINGS 5040
+
+/* the states a worker takes off the frontier at once */
+#define EXPLORE_CHUNK 256
+
+/* nobody woken by a signal, or no step at all */
+#define EXPLORE_NOBODY UINT8_MAX
+
+/* where a gnome is in its loop, a step takes it from one to the next */
+/* the up and down parts mirror each other in the same order */
+enum explore_pc {
+    EXPLORE_LOOP,           // picks up, hangs or throws an ornament, or heads down
+    EXPLORE_HANGING,        // installs an ornament
+    EXPLORE_UP_CHECK,       // tests whether the upper level is full
+    EXPLORE_UP_READ_UP,     // reads next_up_id
+    EXPLORE_UP_READ_DOWN,   // reads next_down_id of the upper level
+    EXPLORE_UP_DECIDE,      // acts on the ids it has read
+    EXPLORE_UP_WAIT,        // has claimed next_up_id, locks go_up_mutex to wait
+    EXPLORE_UP_WAITING,     // waits on go_up_cond
+    EXPLORE_UP_INIT,        // has initiated a swap, broadcasts it
+    EXPLORE_UP_CLEAR,       // there's room above, drops its claim on next_up_id
+    EXPLORE_UP_MOVE,        // moves the counters
+    EXPLORE_UP_SIGNAL,      // signals those waiting for the room it left
+    EXPLORE_DOWN_CHECK,
+    EXPLORE_DOWN_READ_UP,
+    EXPLORE_DOWN_READ_DOWN,
+    EXPLORE_DOWN_DECIDE,
+    EXPLORE_DOWN_WAIT,
+    EXPLORE_DOWN_WAITING,
+    EXPLORE_DOWN_INIT,
+    EXPLORE_DOWN_CLEAR,
+    EXPLORE_DOWN_MOVE,
+    EXPLORE_DOWN_SIGNAL,
+    EXPLORE_DONE,           // rests under the tree
+};
+
+static const char *explore_pcs[] = {
+    "on its way", "hangs an ornament",
+    "checks the level above", "about to read next_up_id", "about to read next_down_id",
+    "about to act on the ids read", "about to wait on go_up_cond", "waits on go_up_cond",
+    "about to broadcast a swap", "about to drop its claim", "about to move up",
+    "about to signal",
+    "checks the level below", "about to read next_up_id", "about to read next_down_id",
+    "about to act on the ids read", "about to wait on go_down_cond", "waits on go_down_cond",
+    "about to broadcast a swap", "about to drop its claim", "about to move down",
+    "about to signal",
+    "rests",
+};
+
+/* the layout of a state, a flat int8_t array so it hashes and compares as is */
+#define EXPLORE_NEXT_ENTER 0
+#define EXPLORE_CLOSED 1
+#define EXPLORE_HANGED 2
+#define EXPLORE_LEVELS 3
+
+/* the fields of a level */
+#define EXPLORE_N_GNOMES 0
+#define EXPLORE_NEXT_UP 1
+#define EXPLORE_NEXT_DOWN 2
+#define EXPLORE_N_ORNAMENTS 3   // hanged or being hanged
+#define EXPLORE_LEVEL_SIZE 4
+
+/* the fields of a gnome */
+#define EXPLORE_PC 0
+#define EXPLORE_LEVEL 1
+#define EXPLORE_ORNAMENT 2
+#define EXPLORE_UP_ID 3         // next_up_id as read, -1 when not needed any more
+#define EXPLORE_DOWN_ID 4       // next_down_id as read, -1 when not needed any more
+#define EXPLORE_SWAP 5          // the gnome meant to follow its swap, -1 if none
+#define EXPLORE_GNOME_SIZE 6
+
+#define EXPLORE_MAX_STATE_SIZE \
+    (EXPLORE_LEVELS + EXPLORE_LEVEL_SIZE * EXPLORE_MAX_LEVELS + EXPLORE_GNOME_SIZE * EXPLORE_MAX_GNOMES)
+
+/* what can go wrong, in the order they're reported */
+enum explore_violation {
+    EXPLORE_OK,
+    EXPLORE_OVERSHOOT,
+    EXPLORE_UNDERFLOW,
+    EXPLORE_LOST_SWAP,
+    EXPLORE_DEADLOCK,
+    EXPLORE_LEAK,
+    EXPLORE_N_VIOLATIONS
+};
+
+static const char *explore_violations[] = {
+    "ok",
+    "cap overshoot, a level counts more gnomes than its gnome_cap",
+    "underflow, a level counts fewer than no gnomes",
+    "lost swap, a swap isn't followed by the gnome it was initiated for",
+    "deadlock, gnomes wait and nobody is left to wake them",
+    "leak, every gnome rests and a counter or a queue is left behind",
+};
+
+/* whether a state showing the violation is explored no further */
+static const unsigned char explore_fatal[] = { 0, 1, 1, 1, 1, 1 };
+
+/* a step: who took it and whom its signals woke */
+struct explore_label {
+    uint8_t actor;
+    uint8_t woken[2];
+};
+
+/* what a step did besides changing the state */
+struct explore_step {
+    /* every signal wakes one waiter of the cond, which one is up to the caller */
+    /* a cond is known by the pc of its waiters and their level */
+    unsigned n_signals;
+    int signal_pc[2];
+    long signal_level[2];
+
+    /* found by the step itself, the state it leads to is checked apart */
+    enum explore_violation violation;
+};
+
+struct explore_record {
+    /* the state this one was found from, UINT32_MAX for the initial state */
+    uint32_t parent;
+
+    struct explore_label label;
+
+    /* another worker has found the same state first, this copy is skipped */
+    uint8_t duplicate;
+
+    /* packed by explore_pack */
+    uint8_t state[];
+};
+
+/* the first trace found to a violation */
+struct explore_finding {
+    /* the last state of the trace, UINT32_MAX if nothing is found */
+    uint32_t from;
+
+    /* a step taken from there, its actor EXPLORE_NOBODY if the state shows it */
+    struct explore_label step;
+};
+
+struct explorer {
+    enum explore_grain grain;
+    unsigned n_gnomes;
+    unsigned n_levels;
+    unsigned gnome_cap[EXPLORE_MAX_LEVELS];
+    unsigned ornament_cap[EXPLORE_MAX_LEVELS];
+    unsigned ornaments_max;
+
+    /* how a field of a state is packed: the bits it takes and its smallest value, */
+    /* pcs are numbered among those a kept state can have */
+    uint8_t field_bits[EXPLORE_MAX_STATE_SIZE];
+    int8_t field_min[EXPLORE_MAX_STATE_SIZE];
+    uint8_t field_pc[EXPLORE_MAX_STATE_SIZE];
+    uint8_t pc_code[EXPLORE_DONE + 1];
+    uint8_t code_pc[EXPLORE_DONE + 1];
+
+    /* the bytes of a state, of a packed one and of a record holding one */
+    size_t state_size;
+    size_t packed_size;
+    size_t record_size;
+
+    /* every state found, in the order found, so a depth of the search is a range */
+    uint8_t *records;
+    unsigned long n_records;
+    unsigned long max_states;
+
+    /* open addressing, a slot holds a hash tag and the index of a record + 1 */
+    uint64_t *slots;
+    size_t n_slots;
+
+    /* the depth being expanded is [frontier_start, frontier_end) */
+    unsigned long frontier_start;
+    unsigned long frontier_end;
+    unsigned long frontier_next;
+    unsigned depth;
+
+    /* set when the search is over, full when it ran out of room */
+    unsigned char finished;
+    unsigned char full;
+
+    /* the workers go through the search one depth at a time */
+    unsigned n_workers;
+    pthread_barrier_t barrier;
+
+    unsigned long long n_steps;
+    unsigned long long n_reduced;
+
+    struct explore_finding findings[EXPLORE_N_VIOLATIONS];
+    pthread_mutex_t findings_mutex;
+};
+
+static struct explorer explorer;
+
+int8_t *explore_level(int8_t *state, long level) {
+    return &state[EXPLORE_LEVELS + EXPLORE_LEVEL_SIZE * level];
+}
+
+int8_t *explore_gnome(int8_t *state, unsigned gnome_id) {
+    return &state[EXPLORE_LEVELS + EXPLORE_LEVEL_SIZE * explorer.n_levels
+        + EXPLORE_GNOME_SIZE * gnome_id];
+}
+
+// level -1 goes up through the entrance
+int8_t *explore_up_queue(int8_t *state, long level) {
+    if (level == -1) {
+        return &state[EXPLORE_NEXT_ENTER];
+    }
+    return &explore_level(state, level)[EXPLORE_NEXT_UP];
+}
+
+struct explore_record *explore_record(unsigned long index) {
+    return (struct explore_record *)&explorer.records[index * explorer.record_size];
+}
+
+/* sets how the fields of a state are packed, a field takes as many bits as */
+/* its values need, ids and levels start at -1 */
+void explore_layout() {
+    size_t n_codes = 0;
+    for (size_t pc = 0; pc <= EXPLORE_DONE; pc++) {
+        explorer.pc_code[pc] = n_codes;
+        explorer.code_pc[n_codes] = pc;
+        // between the steps of a record, the other pcs are passed through
+        n_codes += explorer.grain == EXPLORE_LOCK || pc == EXPLORE_LOOP || pc == EXPLORE_HANGING
+            || pc == EXPLORE_UP_CHECK || pc == EXPLORE_UP_WAITING || pc == EXPLORE_DOWN_CHECK
+            || pc == EXPLORE_DOWN_WAITING || pc == EXPLORE_DONE;
+    }
+
+    int min[EXPLORE_MAX_STATE_SIZE];
+    int max[EXPLORE_MAX_STATE_SIZE];
+    memset(explorer.field_pc, 0, explorer.state_size);
+    min[EXPLORE_NEXT_ENTER] = -1;
+    max[EXPLORE_NEXT_ENTER] = explorer.n_gnomes - 1;
+    min[EXPLORE_CLOSED] = 0;
+    max[EXPLORE_CLOSED] = 1;
+    min[EXPLORE_HANGED] = 0;
+    max[EXPLORE_HANGED] = explorer.ornaments_max;
+    for (size_t i = 0; i < explorer.n_levels; i++) {
+        size_t level = EXPLORE_LEVELS + EXPLORE_LEVEL_SIZE * i;
+        min[level + EXPLORE_N_GNOMES] = 0;
+        max[level + EXPLORE_N_GNOMES] = explorer.gnome_cap[i];
+        min[level + EXPLORE_NEXT_UP] = min[level + EXPLORE_NEXT_DOWN] = -1;
+        max[level + EXPLORE_NEXT_UP] = max[level + EXPLORE_NEXT_DOWN] = explorer.n_gnomes - 1;
+        min[level + EXPLORE_N_ORNAMENTS] = 0;
+        max[level + EXPLORE_N_ORNAMENTS] = explorer.ornament_cap[i];
+    }
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        size_t gnome = EXPLORE_LEVELS + EXPLORE_LEVEL_SIZE * explorer.n_levels + EXPLORE_GNOME_SIZE * i;
+        explorer.field_pc[gnome + EXPLORE_PC] = 1;
+        min[gnome + EXPLORE_PC] = 0;
+        max[gnome + EXPLORE_PC] = n_codes - 1;
+        min[gnome + EXPLORE_LEVEL] = -1;
+        max[gnome + EXPLORE_LEVEL] = explorer.n_levels - 1;
+        min[gnome + EXPLORE_ORNAMENT] = 0;
+        max[gnome + EXPLORE_ORNAMENT] = 1;
+        // the ids read are dropped before a step of a record ends
+        min[gnome + EXPLORE_UP_ID] = min[gnome + EXPLORE_DOWN_ID] = -1;
+        max[gnome + EXPLORE_UP_ID] = max[gnome + EXPLORE_DOWN_ID]
+            = explorer.grain == EXPLORE_LOCK ? (int)explorer.n_gnomes - 1 : -1;
+        min[gnome + EXPLORE_SWAP] = -1;
+        max[gnome + EXPLORE_SWAP] = explorer.n_gnomes - 1;
+    }
+
+    size_t n_bits = 0;
+    for (size_t i = 0; i < explorer.state_size; i++) {
+        explorer.field_min[i] = min[i];
+        explorer.field_bits[i] = 0;
+        while ((1 << explorer.field_bits[i]) <= max[i] - min[i]) {
+            explorer.field_bits[i] += 1;
+        }
+        n_bits += explorer.field_bits[i];
+    }
+    explorer.packed_size = (n_bits + 7) / 8;
+}
+
+/* packs a state into explorer.packed_size bytes, the values have to fit the layout */
+void explore_pack(const int8_t *state, uint8_t *packed) {
+    uint64_t bits = 0;
+    unsigned n_bits = 0;
+    for (size_t i = 0; i < explorer.state_size; i++) {
+        unsigned value = explorer.field_pc[i] ? explorer.pc_code[(int)state[i]]
+            : state[i] - explorer.field_min[i];
+        bits |= (uint64_t)value << n_bits;
+        n_bits += explorer.field_bits[i];
+        while (n_bits >= 8) {
+            *packed++ = bits;
+            bits >>= 8;
+            n_bits -= 8;
+        }
+    }
+    if (n_bits > 0) {
+        *packed = bits;
+    }
+}
+
+void explore_unpack(const uint8_t *packed, int8_t *state) {
+    uint64_t bits = 0;
+    unsigned n_bits = 0;
+    for (size_t i = 0; i < explorer.state_size; i++) {
+        while (n_bits < explorer.field_bits[i]) {
+            bits |= (uint64_t)*packed++ << n_bits;
+            n_bits += 8;
+        }
+        unsigned value = bits & ((1u << explorer.field_bits[i]) - 1);
+        bits >>= explorer.field_bits[i];
+        n_bits -= explorer.field_bits[i];
+        state[i] = explorer.field_pc[i] ? explorer.code_pc[value] : (int)value + explorer.field_min[i];
+    }
+}
+
+void explore_init_state(int8_t *state) {
+    memset(state, 0, explorer.state_size);
+    state[EXPLORE_NEXT_ENTER] = -1;
+    state[EXPLORE_CLOSED] = explorer.ornaments_max == 0;
+    for (size_t i = 0; i < explorer.n_levels; i++) {
+        explore_level(state, i)[EXPLORE_NEXT_UP] = -1;
+        explore_level(state, i)[EXPLORE_NEXT_DOWN] = -1;
+    }
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        int8_t *gnome = explore_gnome(state, i);
+        gnome[EXPLORE_PC] = EXPLORE_LOOP;
+        gnome[EXPLORE_LEVEL] = -1;
+        gnome[EXPLORE_UP_ID] = -1;
+        gnome[EXPLORE_DOWN_ID] = -1;
+        gnome[EXPLORE_SWAP] = -1;
+    }
+}
+
+/* wakes every gnome waiting on the cond */
+void explore_broadcast(int8_t *state, int waiting_pc, long level) {
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        int8_t *gnome = explore_gnome(state, i);
+        if (gnome[EXPLORE_PC] == waiting_pc && gnome[EXPLORE_LEVEL] == level) {
+            // back to the while condition
+            gnome[EXPLORE_PC] = waiting_pc - (EXPLORE_UP_WAITING - EXPLORE_UP_CHECK);
+        }
+    }
+}
+
+/* wakes the gnome if it's waiting on the cond, nobody if there's no waiter */
+/* returns 0 on success, -1 if that's not how the signal can go */
+int explore_wake(int8_t *state, int waiting_pc, long level, uint8_t woken) {
+    unsigned char any = 0;
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        int8_t *gnome = explore_gnome(state, i);
+        any |= gnome[EXPLORE_PC] == waiting_pc && gnome[EXPLORE_LEVEL] == level;
+    }
+    if (woken == EXPLORE_NOBODY) {
+        return any ? -1 : 0;
+    }
+
+    if (woken >= explorer.n_gnomes) {
+        return -1;
+    }
+    int8_t *gnome = explore_gnome(state, woken);
+    if (gnome[EXPLORE_PC] != waiting_pc || gnome[EXPLORE_LEVEL] != level) {
+        return -1;
+    }
+    gnome[EXPLORE_PC] = waiting_pc - (EXPLORE_UP_WAITING - EXPLORE_UP_CHECK);
+    return 0;
+}
+
+void explore_signal(struct explore_step *step, int waiting_pc, long level) {
+    step->signal_pc[step->n_signals] = waiting_pc;
+    step->signal_level[step->n_signals] = level;
+    step->n_signals += 1;
+}
+
+/* a gnome leaves its level on its own, nobody may be waiting for it to follow */
+void explore_leave(int8_t *state, unsigned gnome_id, struct explore_step *step) {
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        if (explore_gnome(state, i)[EXPLORE_SWAP] == (int8_t)gnome_id) {
+            step->violation = EXPLORE_LOST_SWAP;
+        }
+    }
+}
+
+/* a gnome follows the swap it has read the initiator of */
+void explore_follow(int8_t *state, unsigned gnome_id, long initiator_id, struct explore_step *step) {
+    int8_t *initiator = explore_gnome(state, initiator_id);
+    if (initiator[EXPLORE_SWAP] != (int8_t)gnome_id) {
+        step->violation = EXPLORE_LOST_SWAP;
+        return;
+    }
+    initiator[EXPLORE_SWAP] = -1;
+}
+
+/* runs the next critical section of the gnome on the state */
+/* returns 0 on success, -1 if the gnome can't move */
+int explore_section(int8_t *state, unsigned actor, struct explore_step *step) {
+    step->n_signals = 0;
+    step->violation = EXPLORE_OK;
+
+    int8_t *gnome = explore_gnome(state, actor);
+    long level = gnome[EXPLORE_LEVEL];
+    int pc = gnome[EXPLORE_PC];
+
+    if (pc == EXPLORE_DONE) {
+        return -1;
+    }
+
+    if (pc == EXPLORE_HANGING) {
+        state[EXPLORE_HANGED] += 1;
+        state[EXPLORE_CLOSED] = state[EXPLORE_HANGED] == (int8_t)explorer.ornaments_max;
+        gnome[EXPLORE_ORNAMENT] = 0;
+        gnome[EXPLORE_PC] = EXPLORE_LOOP;
+        return 0;
+    }
+
+    if (pc == EXPLORE_LOOP) {
+        if (level == -1 && !gnome[EXPLORE_ORNAMENT]) {
+            if (state[EXPLORE_CLOSED]) {
+                gnome[EXPLORE_PC] = EXPLORE_DONE;
+                return 0;
+            }
+            gnome[EXPLORE_ORNAMENT] = 1;
+            gnome[EXPLORE_PC] = EXPLORE_UP_CHECK;
+            return 0;
+        }
+        if (level == -1) {
+            gnome[EXPLORE_PC] = EXPLORE_UP_CHECK;
+            return 0;
+        }
+
+        if (!gnome[EXPLORE_ORNAMENT] && level > 0) {
+            gnome[EXPLORE_PC] = EXPLORE_DOWN_CHECK;
+            return 0;
+        }
+
+        // down to the ground floor, there's always room
+        if (!gnome[EXPLORE_ORNAMENT]) {
+            explore_level(state, 0)[EXPLORE_N_GNOMES] -= 1;
+            if (explorer.n_levels > 1) {
+                explore_broadcast(state, EXPLORE_DOWN_WAITING, 1);
+            }
+            explore_broadcast(state, EXPLORE_UP_WAITING, -1);
+            explore_leave(state, actor, step);
+            gnome[EXPLORE_LEVEL] = -1;
+            return 0;
+        }
+
+        int8_t *current = explore_level(state, level);
+        if (current[EXPLORE_N_ORNAMENTS] < (int8_t)explorer.ornament_cap[level]) {
+            current[EXPLORE_N_ORNAMENTS] += 1;
+            gnome[EXPLORE_PC] = EXPLORE_HANGING;
+        } else if (level == explorer.n_levels - 1) {
+            gnome[EXPLORE_ORNAMENT] = 0;
+        } else {
+            gnome[EXPLORE_PC] = EXPLORE_UP_CHECK;
+        }
+        return 0;
+    }
+
+    // the queues and conds between the level and the one the gnome goes to,
+    // up_queue/down_queue are next_up_id below and next_down_id above
+    unsigned char up = pc < EXPLORE_DOWN_CHECK;
+    int first_pc = up ? EXPLORE_UP_CHECK : EXPLORE_DOWN_CHECK;
+    long target = up ? level + 1 : level - 1;
+    long below = up ? level : target;
+    int8_t *up_queue = explore_up_queue(state, below);
+    int8_t *down_queue = &explore_level(state, below + 1)[EXPLORE_NEXT_DOWN];
+    int8_t *my_queue = up ? up_queue : down_queue;
+    int my_cond = up ? EXPLORE_UP_WAITING : EXPLORE_DOWN_WAITING;
+    int their_cond = up ? EXPLORE_DOWN_WAITING : EXPLORE_UP_WAITING;
+    int8_t *my_id = &gnome[up ? EXPLORE_UP_ID : EXPLORE_DOWN_ID];
+    int8_t *their_id = &gnome[up ? EXPLORE_DOWN_ID : EXPLORE_UP_ID];
+
+    switch (pc - first_pc + EXPLORE_UP_CHECK) {
+    case EXPLORE_UP_CHECK:
+        if (explore_level(state, target)[EXPLORE_N_GNOMES] == (int8_t)explorer.gnome_cap[target]) {
+            gnome[EXPLORE_PC] = first_pc + EXPLORE_UP_READ_UP - EXPLORE_UP_CHECK;
+        } else {
+            gnome[EXPLORE_PC] = first_pc + EXPLORE_UP_CLEAR - EXPLORE_UP_CHECK;
+        }
+        return 0;
+    case EXPLORE_UP_READ_UP:
+        gnome[EXPLORE_UP_ID] = *up_queue;
+        gnome[EXPLORE_PC] += 1;
+        return 0;
+    case EXPLORE_UP_READ_DOWN:
+        gnome[EXPLORE_DOWN_ID] = *down_queue;
+        gnome[EXPLORE_PC] += 1;
+        return 0;
+    case EXPLORE_UP_DECIDE:
+        // somebody waits on the other side, swap
+        if (*my_id == -1 && *their_id != -1) {
+            *my_queue = actor;
+            gnome[EXPLORE_SWAP] = *their_id;
+            gnome[EXPLORE_PC] = first_pc + EXPLORE_UP_INIT - EXPLORE_UP_CHECK;
+        // occupy the queue, then wait
+        } else if (*my_id == -1) {
+            *my_queue = actor;
+            gnome[EXPLORE_PC] = first_pc + EXPLORE_UP_WAIT - EXPLORE_UP_CHECK;
+        } else if (*my_id != (int8_t)actor || *their_id == -1) {
+            gnome[EXPLORE_PC] = first_pc + EXPLORE_UP_WAITING - EXPLORE_UP_CHECK;
+        // the other side wants to swap
+        } else {
+            *up_queue = -1;
+            *down_queue = -1;
+            explore_broadcast(state, my_cond, level);
+            explore_broadcast(state, their_cond, target);
+            explore_follow(state, actor, *their_id, step);
+            gnome[EXPLORE_LEVEL] = target;
+            gnome[EXPLORE_PC] = EXPLORE_LOOP;
+        }
+        *my_id = -1;
+        *their_id = -1;
+        return 0;
+    case EXPLORE_UP_WAIT:
+        gnome[EXPLORE_PC] += 1;
+        return 0;
+    case EXPLORE_UP_WAITING:
+        return -1;
+    case EXPLORE_UP_INIT:
+        explore_broadcast(state, their_cond, target);
+        gnome[EXPLORE_LEVEL] = target;
+        gnome[EXPLORE_PC] = EXPLORE_LOOP;
+        return 0;
+    case EXPLORE_UP_CLEAR:
+        if (*my_queue == (int8_t)actor) {
+            *my_queue = -1;
+        }
+        gnome[EXPLORE_PC] += 1;
+        return 0;
+    case EXPLORE_UP_MOVE:
+        explore_level(state, target)[EXPLORE_N_GNOMES] += 1;
+        if (level >= 0) {
+            explore_level(state, level)[EXPLORE_N_GNOMES] -= 1;
+        }
+        explore_leave(state, actor, step);
+        gnome[EXPLORE_PC] += 1;
+        return 0;
+    case EXPLORE_UP_SIGNAL:
+        explore_signal(step, their_cond, target);
+        // nobody waits past the entrance or the top level
+        if (up && level > 0) {
+            explore_signal(step, my_cond, level - 1);
+        } else if (!up && level + 1 < explorer.n_levels) {
+            explore_signal(step, my_cond, level + 1);
+        }
+        gnome[EXPLORE_LEVEL] = target;
+        gnome[EXPLORE_PC] = EXPLORE_LOOP;
+        return 0;
+    }
+    return -1;
+}
+
+/* whether the gnome is between two steps of a record, where sync_leave has */
+/* been called and sync_enter hasn't yet */
+unsigned char explore_between(int8_t *state, unsigned gnome_id) {
+    switch (explore_gnome(state, gnome_id)[EXPLORE_PC]) {
+    case EXPLORE_LOOP:
+    case EXPLORE_HANGING:
+    case EXPLORE_UP_CHECK:
+    case EXPLORE_UP_WAITING:
+    case EXPLORE_DOWN_CHECK:
+    case EXPLORE_DOWN_WAITING:
+    case EXPLORE_DONE:
+        return 1;
+    }
+    return 0;
+}
+
+/* takes the next step of the gnome on the state, only the last critical */
+/* section of a step signals, the violation is the first one any of them found */
+/* returns 0 on success, -1 if the gnome can't move */
+int explore_step(int8_t *state, unsigned actor, struct explore_step *step) {
+    if (explore_section(state, actor, step) == -1) {
+        return -1;
+    }
+    enum explore_violation violation = step->violation;
+    while (explorer.grain == EXPLORE_SYNC && !explore_between(state, actor)) {
+        explore_section(state, actor, step);
+        violation = violation != EXPLORE_OK ? violation : step->violation;
+    }
+    step->violation = violation;
+    return 0;
+}
+
+/* a violation the state shows, EXPLORE_OK if none */
+enum explore_violation explore_check(int8_t *state) {
+    for (size_t i = 0; i < explorer.n_levels; i++) {
+        int8_t n_gnomes = explore_level(state, i)[EXPLORE_N_GNOMES];
+        if (n_gnomes > (int8_t)explorer.gnome_cap[i]) {
+            return EXPLORE_OVERSHOOT;
+        }
+        if (n_gnomes < 0) {
+            return EXPLORE_UNDERFLOW;
+        }
+    }
+    return EXPLORE_OK;
+}
+
+/* the violation a state shows once no gnome can take a step, EXPLORE_OK if none */
+enum explore_violation explore_final(int8_t *state) {
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        if (explore_gnome(state, i)[EXPLORE_PC] != EXPLORE_DONE) {
+            return EXPLORE_DEADLOCK;
+        }
+    }
+
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        if (explore_gnome(state, i)[EXPLORE_SWAP] != -1) {
+            return EXPLORE_LOST_SWAP;
+        }
+    }
+    if (state[EXPLORE_NEXT_ENTER] != -1) {
+        return EXPLORE_LEAK;
+    }
+    for (size_t i = 0; i < explorer.n_levels; i++) {
+        int8_t *level = explore_level(state, i);
+        if (level[EXPLORE_N_GNOMES] != 0 || level[EXPLORE_NEXT_UP] != -1
+                || level[EXPLORE_NEXT_DOWN] != -1) {
+            return EXPLORE_LEAK;
+        }
+    }
+    return EXPLORE_OK;
+}
+
+/* whether no gnome of the state can take a step */
+unsigned char explore_stuck(int8_t *state) {
+    int8_t next[explorer.state_size];
+    struct explore_step step;
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        memcpy(next, state, explorer.state_size);
+        if (explore_step(next, i, &step) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* a step nobody else can tell from not taking it yet, as it only changes the */
+/* gnome itself or counts an ornament that doesn't finish the tree */
+unsigned char explore_invisible(int8_t *state, unsigned gnome_id) {
+    int8_t *gnome = explore_gnome(state, gnome_id);
+    if (gnome[EXPLORE_PC] == EXPLORE_LOOP) {
+        return gnome[EXPLORE_LEVEL] == -1 ? gnome[EXPLORE_ORNAMENT]
+            : !gnome[EXPLORE_ORNAMENT] && gnome[EXPLORE_LEVEL] > 0;
+    }
+    return gnome[EXPLORE_PC] == EXPLORE_HANGING
+        && state[EXPLORE_HANGED] + 1 < (int)explorer.ornaments_max;
+}
+
+/* how a gnome looks without its id, ids referring to itself kept apart */
+/* from those referring to others, and which queue holds its id if any */
+void explore_key(int8_t *state, unsigned gnome_id, uint8_t *key) {
+    int8_t *gnome = explore_gnome(state, gnome_id);
+    key[0] = gnome[EXPLORE_PC];
+    key[1] = gnome[EXPLORE_LEVEL];
+    key[2] = gnome[EXPLORE_ORNAMENT];
+    for (size_t i = 0; i < 3; i++) {
+        int8_t id = gnome[EXPLORE_UP_ID + i];
+        key[3 + i] = id == -1 ? 0 : id == (int8_t)gnome_id ? 1 : 2;
+    }
+
+    key[6] = state[EXPLORE_NEXT_ENTER] == (int8_t)gnome_id;
+    for (size_t i = 0; i < explorer.n_levels && key[6] == 0; i++) {
+        int8_t *level = explore_level(state, i);
+        key[6] = level[EXPLORE_NEXT_UP] == (int8_t)gnome_id ? 2 + 2 * i
+            : level[EXPLORE_NEXT_DOWN] == (int8_t)gnome_id ? 3 + 2 * i : 0;
+    }
+
+    key[7] = 0;
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        key[7] |= explore_gnome(state, i)[EXPLORE_SWAP] == (int8_t)gnome_id;
+    }
+}
+
+/* writes the state into renamed with gnome sorted[i] renamed to i */
+void explore_rename(int8_t *state, const uint8_t *sorted, int8_t *renamed) {
+    uint8_t name[EXPLORE_MAX_GNOMES];
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        name[sorted[i]] = i;
+    }
+
+    memcpy(renamed, state, explore_gnome(state, 0) - state);
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        int8_t *gnome = explore_gnome(renamed, i);
+        memcpy(gnome, explore_gnome(state, sorted[i]), EXPLORE_GNOME_SIZE);
+        for (size_t j = EXPLORE_UP_ID; j <= EXPLORE_SWAP; j++) {
+            gnome[j] = gnome[j] == -1 ? -1 : name[(int)gnome[j]];
+        }
+    }
+    if (renamed[EXPLORE_NEXT_ENTER] != -1) {
+        renamed[EXPLORE_NEXT_ENTER] = name[(int)renamed[EXPLORE_NEXT_ENTER]];
+    }
+    for (size_t i = 0; i < explorer.n_levels; i++) {
+        int8_t *level = explore_level(renamed, i);
+        for (size_t j = EXPLORE_NEXT_UP; j <= EXPLORE_NEXT_DOWN; j++) {
+            level[j] = level[j] == -1 ? -1 : name[(int)level[j]];
+        }
+    }
+}
+
+/* moves on to the next order of the distinct ids in [first, last), the ascending */
+/* one after the descending one; returns 0 once it has wrapped around, 1 otherwise */
+unsigned char explore_permute(uint8_t *first, uint8_t *last) {
+    uint8_t *i = last - 1;
+    while (i > first && i[-1] > i[0]) {
+        i -= 1;
+    }
+    unsigned char wrapped = i == first;
+    if (!wrapped) {
+        uint8_t *j = last - 1;
+        while (*j < i[-1]) {
+            j -= 1;
+        }
+        uint8_t swapped = i[-1];
+        i[-1] = *j;
+        *j = swapped;
+    }
+    for (uint8_t *j = last - 1; i < j; i++, j--) {
+        uint8_t swapped = *i;
+        *i = *j;
+        *j = swapped;
+    }
+    return !wrapped;
+}
+
+/* renames the gnomes so that states differing only in which gnome is which */
+/* end up the same, the protocol only ever compares ids for equality. The gnomes */
+/* are sorted by how they look, and the ones that look the same but refer to */
+/* others or are referred to are tried in every order for the smallest state */
+/* order[i] is set to the gnome now named i, unless order is NULL */
+void explore_canonical(int8_t *state, uint8_t *order) {
+    uint8_t keys[EXPLORE_MAX_GNOMES][8];
+    uint8_t sorted[EXPLORE_MAX_GNOMES];
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        explore_key(state, i, keys[i]);
+        size_t j = i;
+        for (; j > 0 && memcmp(keys[sorted[j - 1]], keys[i], sizeof(keys[i])) > 0; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = i;
+    }
+
+    // the runs of gnomes that look the same and whose order matters,
+    // each starts in ascending order of the ids
+    size_t group_first[EXPLORE_MAX_GNOMES];
+    size_t group_last[EXPLORE_MAX_GNOMES];
+    size_t n_groups = 0;
+    unsigned long n_renamings = 1;
+    for (size_t i = 0, j; i < explorer.n_gnomes; i = j) {
+        unsigned char referred = 0;
+        for (j = i; j < explorer.n_gnomes && memcmp(keys[sorted[i]], keys[sorted[j]], 8) == 0; j++) {
+            uint8_t *key = keys[sorted[j]];
+            referred |= key[3] == 2 || key[4] == 2 || key[5] == 2 || key[7];
+        }
+        if (j - i < 2 || !referred) {
+            continue;
+        }
+        group_first[n_groups] = i;
+        group_last[n_groups] = j;
+        n_groups += 1;
+        for (size_t k = 2; k <= j - i && n_renamings <= EXPLORE_MAX_RENAMINGS; k++) {
+            n_renamings *= k;
+        }
+    }
+    if (n_renamings > EXPLORE_MAX_RENAMINGS) {
+        n_groups = 0;
+    }
+
+    int8_t best[EXPLORE_MAX_STATE_SIZE];
+    int8_t renamed[EXPLORE_MAX_STATE_SIZE];
+    uint8_t best_sorted[EXPLORE_MAX_GNOMES];
+    explore_rename(state, sorted, best);
+    memcpy(best_sorted, sorted, explorer.n_gnomes);
+    while (n_groups > 0) {
+        // like an odometer, the last group turns fastest
+        size_t g = n_groups;
+        while (g > 0 && !explore_permute(&sorted[group_first[g - 1]], &sorted[group_last[g - 1]])) {
+            g -= 1;
+        }
+        if (g == 0) {
+            break;
+        }
+        explore_rename(state, sorted, renamed);
+        if (memcmp(renamed, best, explorer.state_size) < 0) {
+            memcpy(best, renamed, explorer.state_size);
+            memcpy(best_sorted, sorted, explorer.n_gnomes);
+        }
+    }
+
+    memcpy(state, best, explorer.state_size);
+    if (order != (uint8_t *)0) {
+        memcpy(order, best_sorted, explorer.n_gnomes);
+    }
+}
+
+uint64_t explore_hash(const uint8_t *packed) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < explorer.packed_size; i++) {
+        hash = (hash ^ packed[i]) * 0x100000001b3ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* adds the packed state to the ones found unless it's there already */
+/* returns 1 if it's new, 0 if it's not, -1 if there's no room left */
+int explore_insert(const uint8_t *packed, uint32_t parent, const struct explore_label *label) {
+    uint64_t hash = explore_hash(packed);
+    uint64_t tag = hash >> 32;
+    size_t i = ((hash & UINT32_MAX) * explorer.n_slots) >> 32;
+    unsigned long index = ULONG_MAX;
+
+    while (1) {
+        uint64_t slot = __atomic_load_n(&explorer.slots[i], __ATOMIC_ACQUIRE);
+        if (slot == 0) {
+            // the record is written before anyone can find it through the slot
+            if (index == ULONG_MAX) {
+                index = __atomic_fetch_add(&explorer.n_records, 1, __ATOMIC_RELAXED);
+                if (index >= explorer.max_states) {
+                    explorer.full = 1;
+                    return -1;
+                }
+                struct explore_record *record = explore_record(index);
+                record->parent = parent;
+                record->label = *label;
+                record->duplicate = 0;
+                memcpy(record->state, packed, explorer.packed_size);
+            }
+            if (__atomic_compare_exchange_n(&explorer.slots[i], &slot, tag << 32 | (index + 1),
+                    0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                return 1;
+            }
+        }
+
+        if (slot >> 32 == tag
+                && memcmp(explore_record((slot & UINT32_MAX) - 1)->state, packed, explorer.packed_size) == 0) {
+            if (index != ULONG_MAX) {
+                explore_record(index)->duplicate = 1;
+            }
+            return 0;
+        }
+        i = i + 1 < explorer.n_slots ? i + 1 : 0;
+    }
+}
+
+void explore_found(enum explore_violation violation, uint32_t from, const struct explore_label *step) {
+    pthread_mutex_lock(&explorer.findings_mutex);
+    if (explorer.findings[violation].from == UINT32_MAX) {
+        explorer.findings[violation].from = from;
+        explorer.findings[violation].step = *step;
+    }
+    pthread_mutex_unlock(&explorer.findings_mutex);
+}
+
+/* checks where a step has led and keeps it for the next depth */
+/* packed is room for a packed state */
+void explore_keep(uint32_t from, int8_t *state, const struct explore_label *label,
+        enum explore_violation violation, uint8_t *packed) {
+    __atomic_fetch_add(&explorer.n_steps, 1, __ATOMIC_RELAXED);
+
+    if (violation == EXPLORE_OK || !explore_fatal[violation]) {
+        enum explore_violation shown = explore_check((int8_t *)state);
+        if (violation == EXPLORE_OK || shown != EXPLORE_OK) {
+            violation = shown;
+        }
+    }
+    if (violation != EXPLORE_OK) {
+        explore_found(violation, from, label);
+        if (explore_fatal[violation]) {
+            return;
+        }
+    }
+    explore_canonical(state, (uint8_t *)0);
+    explore_pack(state, packed);
+    explore_insert(packed, from, label);
+}
+
+/* takes every step there is from a state of the frontier */
+/* scratch is room for three states and a packed one */
+void explore_expand(unsigned long index, int8_t *scratch) {
+    struct explore_record *record = explore_record(index);
+    if (record->duplicate) {
+        return;
+    }
+    int8_t *state = scratch;
+    int8_t *next = scratch + explorer.state_size;
+    int8_t *woken = scratch + 2 * explorer.state_size;
+    uint8_t *packed = (uint8_t *)scratch + 3 * explorer.state_size;
+    explore_unpack(record->state, state);
+    struct explore_step step;
+    struct explore_label label = { EXPLORE_NOBODY, { EXPLORE_NOBODY, EXPLORE_NOBODY } };
+
+    // partial order reduction: an invisible step is as good as every order it
+    // could be taken in, unless it leads back to a state seen before and so
+    // might go round a cycle that never lets the others move
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        if (!explore_invisible(state, i)) {
+            continue;
+        }
+        memcpy(next, state, explorer.state_size);
+        explore_step(next, i, &step);
+        explore_canonical(next, (uint8_t *)0);
+        explore_pack(next, packed);
+        label.actor = i;
+        __atomic_fetch_add(&explorer.n_steps, 1, __ATOMIC_RELAXED);
+        if (explore_insert(packed, index, &label) != 0) {
+            __atomic_fetch_add(&explorer.n_reduced, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        break;
+    }
+
+    unsigned char stuck = 1;
+    for (size_t actor = 0; actor < explorer.n_gnomes; actor++) {
+        memcpy(next, state, explorer.state_size);
+        if (explore_step(next, actor, &step) == -1) {
+            continue;
+        }
+        stuck = 0;
+        label.actor = actor;
+
+        // every waiter a signal may wake, nobody if there's none
+        uint8_t waiters[2][EXPLORE_MAX_GNOMES + 1];
+        unsigned n_waiters[2] = { 1, 1 };
+        waiters[0][0] = waiters[1][0] = EXPLORE_NOBODY;
+        for (size_t s = 0; s < step.n_signals; s++) {
+            n_waiters[s] = 0;
+            for (size_t i = 0; i < explorer.n_gnomes; i++) {
+                int8_t *gnome = explore_gnome(next, i);
+                if (gnome[EXPLORE_PC] == step.signal_pc[s] && gnome[EXPLORE_LEVEL] == step.signal_level[s]) {
+                    waiters[s][n_waiters[s]++] = i;
+                }
+            }
+            if (n_waiters[s] == 0) {
+                waiters[s][n_waiters[s]++] = EXPLORE_NOBODY;
+            }
+        }
+
+        for (size_t i = 0; i < n_waiters[0]; i++) {
+            for (size_t j = 0; j < n_waiters[1]; j++) {
+                memcpy(woken, next, explorer.state_size);
+                label.woken[0] = waiters[0][i];
+                label.woken[1] = waiters[1][j];
+                for (size_t s = 0; s < step.n_signals; s++) {
+                    explore_wake(woken, step.signal_pc[s], step.signal_level[s], label.woken[s]);
+                }
+                explore_keep(index, woken, &label, step.violation, packed);
+            }
+        }
+        label.woken[0] = label.woken[1] = EXPLORE_NOBODY;
+    }
+
+    if (stuck) {
+        enum explore_violation violation = explore_final(state);
+        label.actor = EXPLORE_NOBODY;
+        if (violation != EXPLORE_OK) {
+            explore_found(violation, index, &label);
+        }
+    }
+}
+
+void *explore_worker(void *arg) {
+    int8_t *scratch = (int8_t *)arg;
+
+    // explore() holds the findings mutex until the barrier is set up
+    pthread_mutex_lock(&explorer.findings_mutex);
+    pthread_mutex_unlock(&explorer.findings_mutex);
+    if (explorer.finished) {
+        return NULL;
+    }
+
+    while (1) {
+        pthread_barrier_wait(&explorer.barrier);
+        if (explorer.finished) {
+            break;
+        }
+
+        while (1) {
+            unsigned long first = __atomic_fetch_add(&explorer.frontier_next, EXPLORE_CHUNK, __ATOMIC_RELAXED);
+            if (first >= explorer.frontier_end) {
+                break;
+            }
+            unsigned long last = first + EXPLORE_CHUNK < explorer.frontier_end
+                ? first + EXPLORE_CHUNK : explorer.frontier_end;
+            for (unsigned long i = first; i < last; i++) {
+                explore_expand(i, scratch);
+            }
+        }
+
+        // one of the workers moves the frontier on to the next depth
+        if (pthread_barrier_wait(&explorer.barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            unsigned long end = explorer.n_records < explorer.max_states
+                ? explorer.n_records : explorer.max_states;
+            explorer.frontier_start = explorer.frontier_end;
+            explorer.frontier_end = end;
+            explorer.frontier_next = explorer.frontier_start;
+            explorer.depth += 1;
+            explorer.finished = explorer.full || explorer.frontier_start == explorer.frontier_end;
+            if (explorer.depth % 10 == 0 && !explorer.finished) {
+                printf("explore: depth#%u, %lu states\n", explorer.depth, end);
+                fflush(stdout);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* replays a trace from the initial state, state is left where it ends */
+/* returns the violation its last step shows, EXPLORE_OK if none, */
+/* -1 if the steps can't be taken or another violation stops them first */
+int explore_replay(const struct explore_label *trace, size_t n_steps, int8_t *state) {
+    explore_init_state(state);
+    int violation = EXPLORE_OK;
+    for (size_t i = 0; i < n_steps; i++) {
+        struct explore_step step;
+        if (explore_step(state, trace[i].actor, &step) == -1) {
+            return -1;
+        }
+        for (size_t s = 0; s < step.n_signals; s++) {
+            if (explore_wake(state, step.signal_pc[s], step.signal_level[s], trace[i].woken[s]) == -1) {
+                return -1;
+            }
+        }
+        violation = step.violation;
+        if (violation == EXPLORE_OK || !explore_fatal[violation]) {
+            enum explore_violation shown = explore_check(state);
+            if (shown != EXPLORE_OK) {
+                violation = shown;
+            }
+        }
+        if (i + 1 < n_steps && violation != EXPLORE_OK && explore_fatal[violation]) {
+            return -1;
+        }
+    }
+    if (violation == EXPLORE_OK && explore_stuck(state)) {
+        violation = explore_final(state);
+    }
+    return violation;
+}
+
+/* the stored states have their gnomes renamed after every step, this turns */
+/* a trace through them into one naming the same gnomes all along */
+void explore_concretize(struct explore_label *trace, size_t n_steps, int8_t *state) {
+    uint8_t names[EXPLORE_MAX_GNOMES];
+    uint8_t renamed[EXPLORE_MAX_GNOMES];
+    uint8_t order[EXPLORE_MAX_GNOMES];
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        names[i] = i;
+    }
+
+    explore_init_state(state);
+    explore_canonical(state, (uint8_t *)0);
+    for (size_t i = 0; i < n_steps; i++) {
+        struct explore_step step;
+        explore_step(state, trace[i].actor, &step);
+        for (size_t s = 0; s < step.n_signals; s++) {
+            explore_wake(state, step.signal_pc[s], step.signal_level[s], trace[i].woken[s]);
+        }
+
+        trace[i].actor = names[trace[i].actor];
+        for (size_t s = 0; s < 2; s++) {
+            if (trace[i].woken[s] != EXPLORE_NOBODY) {
+                trace[i].woken[s] = names[trace[i].woken[s]];
+            }
+        }
+
+        explore_canonical(state, order);
+        for (size_t j = 0; j < explorer.n_gnomes; j++) {
+            renamed[j] = names[order[j]];
+        }
+        memcpy(names, renamed, explorer.n_gnomes);
+    }
+}
+
+/* drops every step the violation can do without, until none can go */
+/* returns the number of steps left */
+size_t explore_minimize(struct explore_label *trace, size_t n_steps,
+        enum explore_violation violation, int8_t *state) {
+    unsigned char dropped = 1;
+    while (dropped) {
+        dropped = 0;
+        for (size_t i = n_steps; i-- > 0;) {
+            struct explore_label step = trace[i];
+            memmove(&trace[i], &trace[i + 1], (n_steps - i - 1) * sizeof(struct explore_label));
+            if (explore_replay(trace, n_steps - 1, state) == (int)violation) {
+                n_steps -= 1;
+                dropped = 1;
+                continue;
+            }
+            memmove(&trace[i + 1], &trace[i], (n_steps - i - 1) * sizeof(struct explore_label));
+            trace[i] = step;
+        }
+    }
+    return n_steps;
+}
+
+/* prints what a critical section of a trace did, before and after are the */
+/* states around it */
+void explore_describe(const struct explore_label *label, int8_t *before, int8_t *after) {
+    int8_t *gnome = explore_gnome(before, label->actor);
+    int8_t *moved = explore_gnome(after, label->actor);
+    long level = gnome[EXPLORE_LEVEL];
+    int pc = gnome[EXPLORE_PC];
+    unsigned char up = pc < EXPLORE_DOWN_CHECK;
+    long target = up ? level + 1 : level - 1;
+    long below = up ? level : target;
+    const char *my_queue = !up ? "next_down_id" : below == -1 ? "next_enter_id" : "next_up_id";
+    const char *my_cond = !up ? "go_down_cond" : below == -1 ? "entrance_cond" : "go_up_cond";
+    printf("gnome#%u at level#%ld ", label->actor, level);
+
+    switch (pc >= EXPLORE_DOWN_CHECK && pc < EXPLORE_DONE
+            ? pc - EXPLORE_DOWN_CHECK + EXPLORE_UP_CHECK : pc) {
+    case EXPLORE_LOOP:
+        if (moved[EXPLORE_PC] == EXPLORE_DONE) {
+            printf("rests under the tree");
+        } else if (level == -1 && !gnome[EXPLORE_ORNAMENT]) {
+            printf("picks up an ornament");
+        } else if (moved[EXPLORE_LEVEL] == -1) {
+            printf("moves down to the ground floor");
+        } else if (moved[EXPLORE_PC] == EXPLORE_HANGING) {
+            printf("starts hanging an ornament");
+        } else if (moved[EXPLORE_PC] == EXPLORE_DOWN_CHECK) {
+            printf("heads down");
+        } else if (!moved[EXPLORE_ORNAMENT]) {
+            printf("throws its ornament away");
+        } else {
+            printf("heads up");
+        }
+        break;
+    case EXPLORE_HANGING:
+        printf("finishes hanging an ornament, %d of %u", after[EXPLORE_HANGED], explorer.ornaments_max);
+        break;
+    case EXPLORE_UP_CHECK:
+        printf("finds level#%ld %s", target,
+            moved[EXPLORE_PC] == pc + 1 ? "full" : "with room");
+        break;
+    case EXPLORE_UP_READ_UP:
+        printf("reads %s = %d", below == -1 ? "next_enter_id" : "next_up_id",
+            moved[EXPLORE_UP_ID]);
+        if (below != -1) {
+            printf(" of level#%ld", below);
+        }
+        break;
+    case EXPLORE_UP_READ_DOWN:
+        printf("reads next_down_id = %d of level#%ld", moved[EXPLORE_DOWN_ID], below + 1);
+        break;
+    case EXPLORE_UP_DECIDE:
+        if (moved[EXPLORE_SWAP] != -1 && gnome[EXPLORE_SWAP] == -1) {
+            printf("claims %s to swap with gnome#%d", my_queue, moved[EXPLORE_SWAP]);
+        } else if (moved[EXPLORE_PC] == EXPLORE_LOOP) {
+            printf("follows the swap of gnome#%d to level#%ld",
+                gnome[up ? EXPLORE_DOWN_ID : EXPLORE_UP_ID], target);
+        } else if (moved[EXPLORE_PC] == gnome[EXPLORE_PC] + 1) {
+            printf("claims %s", my_queue);
+        } else {
+            printf("waits on %s", my_cond);
+        }
+        break;
+    case EXPLORE_UP_WAIT:
+        printf("waits on %s", my_cond);
+        break;
+    case EXPLORE_UP_INIT:
+        printf("broadcasts the swap and moves to level#%ld", target);
+        break;
+    case EXPLORE_UP_CLEAR:
+        printf("drops its claim on %s", my_queue);
+        break;
+    case EXPLORE_UP_MOVE:
+        printf("counts itself on level#%ld, %d of %u there now", target,
+            explore_level(after, target)[EXPLORE_N_GNOMES], explorer.gnome_cap[target]);
+        break;
+    case EXPLORE_UP_SIGNAL:
+        printf("signals and moves to level#%ld", target);
+        break;
+    }
+    for (size_t s = 0; s < 2; s++) {
+        if (label->woken[s] != EXPLORE_NOBODY) {
+            printf(", wakes gnome#%u", label->woken[s]);
+        }
+    }
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        int8_t *other = explore_gnome(before, i);
+        if (i != label->actor && i != label->woken[0] && i != label->woken[1]
+                && other[EXPLORE_PC] != explore_gnome(after, i)[EXPLORE_PC]) {
+            printf(", wakes gnome#%lu", i);
+        }
+    }
+    printf("\n");
+}
+
+void explore_print_state(int8_t *state) {
+    printf("  next_enter_id %d, %d of %u ornaments hanged\n",
+        state[EXPLORE_NEXT_ENTER], state[EXPLORE_HANGED], explorer.ornaments_max);
+    for (size_t i = 0; i < explorer.n_levels; i++) {
+        int8_t *level = explore_level(state, i);
+        printf("  level#%lu: %d of %u gnomes, next_up_id %d, next_down_id %d\n",
+            i, level[EXPLORE_N_GNOMES], explorer.gnome_cap[i],
+            level[EXPLORE_NEXT_UP], level[EXPLORE_NEXT_DOWN]);
+    }
+    for (size_t i = 0; i < explorer.n_gnomes; i++) {
+        int8_t *gnome = explore_gnome(state, i);
+        printf("  gnome#%lu: level#%d, %s%s\n", i, gnome[EXPLORE_LEVEL],
+            explore_pcs[(int)gnome[EXPLORE_PC]],
+            gnome[EXPLORE_ORNAMENT] ? ", carries an ornament" : "");
+    }
+}
+
+/* the bytes of memory available, from /proc/meminfo or else the free pages */
+size_t explore_available_memory(void) {
+    FILE *file = fopen("/proc/meminfo", "r");
+    if (file != (FILE *)0) {
+        char line[128];
+        unsigned long kibibytes;
+        while (fgets(line, sizeof(line), file) != (char *)0) {
+            if (sscanf(line, "MemAvailable: %lu kB", &kibibytes) == 1) {
+                fclose(file);
+                return kibibytes * 1024;
+            }
+        }
+        fclose(file);
+    }
+    long n_pages = sysconf(_SC_AVPHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    return n_pages > 0 && page_size > 0 ? (size_t)n_pages * page_size : 0;
+}
+
+/* rebuilds, shortens and prints the trace to a violation */
+/* returns 0 on success, -1 on failure */
+int explore_report(enum explore_violation violation) {
+    struct explore_finding *finding = &explorer.findings[violation];
+
+    size_t n_steps = finding->step.actor != EXPLORE_NOBODY;
+    for (uint32_t i = finding->from; explore_record(i)->parent != UINT32_MAX; i = explore_record(i)->parent) {
+        n_steps += 1;
+    }
+
+    struct explore_label *trace = malloc((n_steps + 1) * sizeof(struct explore_label));
+    int8_t *states = malloc(2 * explorer.state_size);
+    if (trace == (struct explore_label *)0 || states == (int8_t *)0) {
+        free(trace);
+        free(states);
+        fprintf(stderr, "explore_report: failed to malloc the trace\n");
+        return -1;
+    }
+
+    size_t i = n_steps;
+    if (finding->step.actor != EXPLORE_NOBODY) {
+        trace[--i] = finding->step;
+    }
+    for (uint32_t j = finding->from; explore_record(j)->parent != UINT32_MAX; j = explore_record(j)->parent) {
+        trace[--i] = explore_record(j)->label;
+    }
+
+    size_t n_found = n_steps;
+    explore_concretize(trace, n_steps, states);
+    n_steps = explore_minimize(trace, n_steps, violation, states);
+    printf("explore: %s\n", explore_violations[violation]);
+    printf("  %lu steps, %lu as found\n", n_steps, n_found);
+
+    // every critical section of a step on its own line
+    int8_t *before = states;
+    int8_t *after = states + explorer.state_size;
+    explore_init_state(after);
+    for (size_t i = 0; i < n_steps; i++) {
+        unsigned char first = 1;
+        do {
+            struct explore_step step;
+            struct explore_label section = { trace[i].actor, { EXPLORE_NOBODY, EXPLORE_NOBODY } };
+            memcpy(before, after, explorer.state_size);
+            explore_section(after, trace[i].actor, &step);
+            for (size_t s = 0; s < step.n_signals; s++) {
+                section.woken[s] = trace[i].woken[s];
+                explore_wake(after, step.signal_pc[s], step.signal_level[s], trace[i].woken[s]);
+            }
+            if (first) {
+                printf("  #%-4lu ", i);
+            } else {
+                printf("        ");
+            }
+            explore_describe(&section, before, after);
+            first = 0;
+        } while (explorer.grain == EXPLORE_SYNC && !explore_between(after, trace[i].actor));
+    }
+    printf("  which leaves:\n");
+    explore_print_state(after);
+
+    free(trace);
+    free(states);
+    return 0;
+}
+
+/* sets the explorer up for a tree of the config */
+/* returns 0 on success, -1 if the model can't take the config */
+int explore_model(const struct xmas_config *config, enum explore_grain grain) {
+    if (check_xmas_tree(config->n_gnomes, config->n_levels, config->gnome_cap_list) == -1) {
+        return -1;
+    }
+    if (config->n_gnomes > EXPLORE_MAX_GNOMES || config->n_levels > EXPLORE_MAX_LEVELS) {
+        fprintf(stderr, "explore: at most %u gnomes and %u levels\n",
+            EXPLORE_MAX_GNOMES, EXPLORE_MAX_LEVELS);
+        return -1;
+    }
+    explorer.grain = grain;
+    explorer.n_gnomes = config->n_gnomes;
+    explorer.n_levels = config->n_levels;
+    explorer.ornaments_max = 0;
+    for (size_t i = 0; i < config->n_levels; i++) {
+        explorer.gnome_cap[i] = config->gnome_cap_list[i];
+        explorer.ornament_cap[i] = config->ornament_cap_list[i];
+        explorer.ornaments_max += config->ornament_cap_list[i];
+        if (config->gnome_cap_list[i] > EXPLORE_MAX_GNOMES) {
+            fprintf(stderr, "explore: a gnome_cap of at most %u\n", EXPLORE_MAX_GNOMES);
+            return -1;
+        }
+    }
+    if (explorer.ornaments_max > EXPLORE_MAX_ORNAMENTS) {
+        fprintf(stderr, "explore: at most %u ornaments\n", EXPLORE_MAX_ORNAMENTS);
+        return -1;
+    }
+    if (config->ornaments_per_delivery == 0 && explorer.ornaments_max > 0) {
+        fprintf(stderr, "explore: no ornaments ever get delivered\n");
+        return -1;
+    }
+    explorer.state_size = EXPLORE_LEVELS + EXPLORE_LEVEL_SIZE * explorer.n_levels
+        + EXPLORE_GNOME_SIZE * explorer.n_gnomes;
+    explore_layout();
+    return 0;
+}
+
+/* explores every state a tree of the config gets into and reports each kind */
+/* of violation with the shortest trace found, trimmed of the steps it doesn't need. */
+/* Times don't matter, every order of the steps is taken; n_trees doesn't either */
+/* returns 0 if the protocol holds, -1 on a violation or failure */
+int explore(const struct xmas_config *config, enum explore_grain grain) {
+    if (explore_model(config, grain) == -1) {
+        return -1;
+    }
+    explorer.record_size = (sizeof(struct explore_record) + explorer.packed_size + 3) & ~(size_t)3;
+
+    // a state takes its record and its share of the slots, a record index fits a slot
+    double budget = EXPLORE_MEMORY_SHARE * explore_available_memory();
+    double max_states = budget / (explorer.record_size + EXPLORE_SLOTS_PER_STATE * sizeof(uint64_t));
+    if (max_states > (UINT32_MAX - 1) / EXPLORE_SLOTS_PER_STATE) {
+        max_states = (UINT32_MAX - 1) / EXPLORE_SLOTS_PER_STATE;
+    }
+    if (max_states < 1) {
+        fprintf(stderr, "explore: no memory available for the states\n");
+        return -1;
+    }
+    explorer.max_states = max_states;
+    explorer.n_slots = EXPLORE_SLOTS_PER_STATE * explorer.max_states + 1;
+
+    // pages are only backed once touched
+    explorer.records = mmap(NULL, explorer.max_states * explorer.record_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (explorer.records == MAP_FAILED) {
+        fprintf(stderr, "explore: failed to mmap the records\n");
+        return -1;
+    }
+    explorer.slots = mmap(NULL, explorer.n_slots * sizeof(uint64_t),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (explorer.slots == MAP_FAILED) {
+        fprintf(stderr, "explore: failed to mmap the hash table\n");
+        munmap(explorer.records, explorer.max_states * explorer.record_size);
+        return -1;
+    }
+
+    long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    explorer.n_workers = n_workers > 0 ? n_workers : 1;
+
+    pthread_t *workers = malloc(explorer.n_workers * sizeof(pthread_t));
+    size_t scratch_size = 3 * explorer.state_size + explorer.packed_size;
+    int8_t *scratch = malloc(explorer.n_workers * scratch_size);
+    if (workers == (pthread_t *)0 || scratch == (int8_t *)0) {
+        fprintf(stderr, "explore: failed to malloc the workers\n");
+        free(workers);
+        free(scratch);
+        munmap(explorer.slots, explorer.n_slots * sizeof(uint64_t));
+        munmap(explorer.records, explorer.max_states * explorer.record_size);
+        return -1;
+    }
+
+    if (pthread_mutex_init(&explorer.findings_mutex, NULL) != 0) {
+        fprintf(stderr, "explore: failed to init the findings mutex\n");
+        free(workers);
+        free(scratch);
+        munmap(explorer.slots, explorer.n_slots * sizeof(uint64_t));
+        munmap(explorer.records, explorer.max_states * explorer.record_size);
+        return -1;
+    }
+
+    for (size_t i = 0; i < EXPLORE_N_VIOLATIONS; i++) {
+        explorer.findings[i].from = UINT32_MAX;
+    }
+    explorer.n_records = 0;
+    explorer.n_steps = 0;
+    explorer.n_reduced = 0;
+    explorer.depth = 0;
+    explorer.full = 0;
+    explorer.finished = 0;
+
+    struct explore_label none = { EXPLORE_NOBODY, { EXPLORE_NOBODY, EXPLORE_NOBODY } };
+    explore_init_state(scratch);
+    explore_canonical(scratch, (uint8_t *)0);
+    explore_pack(scratch, (uint8_t *)scratch + explorer.state_size);
+    explore_insert((uint8_t *)scratch + explorer.state_size, UINT32_MAX, &none);
+    explorer.frontier_start = 0;
+    explorer.frontier_end = 1;
+    explorer.frontier_next = 0;
+
+    printf("explore: %s steps, %u gnomes, %u levels, %u ornaments, %u workers, room for %lu states\n",
+        explore_grains[grain], explorer.n_gnomes, explorer.n_levels,
+        explorer.ornaments_max, explorer.n_workers, explorer.max_states);
+
+    struct timespec started_at;
+    struct timespec finished_at;
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+
+    // the workers hold on until the barrier knows how many of them there are
+    pthread_mutex_lock(&explorer.findings_mutex);
+    size_t n_started = 0;
+    for (; n_started < explorer.n_workers; n_started++) {
+        if (pthread_create(&workers[n_started], NULL, explore_worker,
+                &scratch[n_started * scratch_size]) != 0) {
+            fprintf(stderr, "explore: failed to create workers[%lu], going on without the rest\n",
+                n_started);
+            break;
+        }
+    }
+    explorer.n_workers = n_started;
+    unsigned char barrier_set = n_started > 0
+        && pthread_barrier_init(&explorer.barrier, NULL, n_started) == 0;
+    int result = 0;
+    if (!barrier_set) {
+        fprintf(stderr, "explore: failed to start the workers\n");
+        explorer.finished = 1;
+        result = -1;
+    }
+    pthread_mutex_unlock(&explorer.findings_mutex);
+
+    for (size_t i = 0; i < n_started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished_at);
+
+    if (result == 0) {
+        unsigned long n_states = explorer.n_records < explorer.max_states
+            ? explorer.n_records : explorer.max_states;
+        printf("explore: %lu states, %llu steps (%llu reduced) up to depth#%u in %.3fs\n",
+            n_states, explorer.n_steps, explorer.n_reduced, explorer.depth,
+            seconds_between(&started_at, &finished_at));
+        if (explorer.full) {
+            printf("explore: out of room after %lu states, the search is not exhaustive\n",
+                explorer.max_states);
+            result = -1;
+        }
+
+        for (size_t i = EXPLORE_OK + 1; i < EXPLORE_N_VIOLATIONS; i++) {
+            if (explorer.findings[i].from == UINT32_MAX) {
+                printf("explore: no %s%s\n", explore_violations[i],
+                    explorer.full ? ", as far as it got" : "");
+                continue;
+            }
+            explore_report(i);
+            result = -1;
+        }
+    }
+
+    if (barrier_set) {
+        pthread_barrier_destroy(&explorer.barrier);
+    }
+    pthread_mutex_destroy(&explorer.findings_mutex);
+    free(workers);
+    free(scratch);
+    munmap(explorer.slots, explorer.n_slots * sizeof(uint64_t));
+    munmap(explorer.records, explorer.max_states * explorer.record_size);
+    return result;
+}
+
+/* the kind of record event a sync step of the gnome stands for, before and */
+/* after are the states around it, partner is set to the other side of a swap */
+/* returns 0 for a step no record shows, heading up or down from the loop */
+unsigned explore_kind(int8_t *before, int8_t *after, unsigned actor, unsigned *partner) {
+    int8_t *gnome = explore_gnome(before, actor);
+    int8_t *moved = explore_gnome(after, actor);
+    long level = gnome[EXPLORE_LEVEL];
+    int pc = gnome[EXPLORE_PC];
+    *partner = SYNC_NOBODY;
+
+    if (pc == EXPLORE_HANGING) {
+        return SYNC_HANG_DONE;
+    }
+    if (pc == EXPLORE_LOOP) {
+        // a gnome only rests once every tree is done, it looks for ornaments till then
+        if (moved[EXPLORE_PC] == EXPLORE_DONE) {
+            return SYNC_PICK_NONE;
+        }
+        if (level == -1) {
+            return gnome[EXPLORE_ORNAMENT] ? 0 : SYNC_PICK_UP;
+        }
+        if (!gnome[EXPLORE_ORNAMENT]) {
+            return level == 0 ? SYNC_MOVE_DOWN : 0;
+        }
+        return moved[EXPLORE_PC] == EXPLORE_HANGING ? SYNC_HANG_START : SYNC_HANG_FULL;
+    }
+
+    // the down kinds mirror the up ones in the same order
+    unsigned char up = pc < EXPLORE_DOWN_CHECK;
+    unsigned down = up ? 0 : SYNC_CLAIM_DOWN - SYNC_CLAIM_UP;
+    long target = up ? level + 1 : level - 1;
+    long below = up ? level : target;
+    int8_t up_queue = *explore_up_queue(before, below);
+    int8_t down_queue = explore_level(before, below + 1)[EXPLORE_NEXT_DOWN];
+    int8_t my_queue = up ? up_queue : down_queue;
+
+    if (moved[EXPLORE_PC] == (up ? EXPLORE_UP_WAITING : EXPLORE_DOWN_WAITING)) {
+        return (my_queue == -1 ? SYNC_CLAIM_UP : SYNC_WAIT_UP) + down;
+    }
+    if (explore_level(before, target)[EXPLORE_N_GNOMES] != (int8_t)explorer.gnome_cap[target]) {
+        return SYNC_MOVE_UP + down;
+    }
+
+    // a swap, the gnome has either claimed its queue before or claims it now
+    *partner = up ? down_queue : up_queue;
+    return (my_queue == -1 ? SYNC_SWAP_INIT_UP : SYNC_SWAP_FOLLOW_UP) + down;
+}
+
+/* takes the step of a record event on the state, next is room for a state, */
+/* shown flags the violations the record has been found to show so far */
+/* returns 0 on success, -1 if the model can't take it */
+int explore_check_event(int8_t *state, int8_t *next, size_t index, const struct sync_event *event,
+        unsigned char *shown) {
+    unsigned actor = event->actor;
+    unsigned kind = event->kind & ~SYNC_WOKEN;
+    struct explore_step step;
+    unsigned model_kind = 0;
+    unsigned partner;
+    long level;
+
+    // a step no record shows leads to one it does
+    while (model_kind == 0) {
+        level = explore_gnome(state, actor)[EXPLORE_LEVEL];
+        memcpy(next, state, explorer.state_size);
+        if (explore_step(next, actor, &step) == -1) {
+            printf("explore: event#%lu, gnome#%u %s, but in the model it %s\n", index, actor,
+                sync_kinds[kind], explore_pcs[(int)explore_gnome(state, actor)[EXPLORE_PC]]);
+            return -1;
+        }
+        model_kind = explore_kind(state, next, actor, &partner);
+        memcpy(state, next, explorer.state_size);
+    }
+
+    if (model_kind != kind || level != event->level) {
+        printf("explore: event#%lu, gnome#%u %s at level#%d, but in the model it %s at level#%ld\n",
+            index, actor, sync_kinds[kind], event->level, sync_kinds[model_kind], level);
+        return -1;
+    }
+    if (partner != event->partner) {
+        printf("explore: event#%lu, gnome#%u %s with gnome#%u, but in the model with gnome#%u\n",
+            index, actor, sync_kinds[kind], event->partner, partner);
+        return -1;
+    }
+
+    for (size_t s = 0; s < 2; s++) {
+        uint8_t woken = event->woken[s] == SYNC_NOBODY ? EXPLORE_NOBODY : event->woken[s];
+        if (s < step.n_signals
+                ? explore_wake(state, step.signal_pc[s], step.signal_level[s], woken) == 0
+                : woken == EXPLORE_NOBODY) {
+            continue;
+        }
+        printf("explore: event#%lu, gnome#%u %s and its signal#%lu wakes ",
+            index, actor, sync_kinds[kind], s);
+        if (woken == EXPLORE_NOBODY) {
+            printf("nobody");
+        } else {
+            printf("gnome#%u", woken);
+        }
+        printf(", which the model doesn't\n");
+        return -1;
+    }
+
+    // the model has the run go wrong too, a violation is no reason to stop checking
+    enum explore_violation violation = step.violation != EXPLORE_OK ? step.violation : explore_check(state);
+    if (violation != EXPLORE_OK && !shown[violation]) {
+        printf("explore: event#%lu, gnome#%u %s, the run shows %s\n",
+            index, actor, sync_kinds[kind], explore_violations[violation]);
+        shown[violation] = 1;
+    }
+    return 0;
+}
+
+/* checks that a record of the config is a trace the model takes in sync steps: */
+/* tree by tree, every step of a gnome is one the model has it take next, doing */
+/* the same and waking the same gnomes. Santa's steps and finding nothing to pick */
+/* up are left out, the model has santa deliver before any gnome looks */
+/* returns 0 if the model takes the whole record, -1 if not or on failure */
+int explore_check_record(const struct xmas_config *config, const char *path) {
+    if (explore_model(config, EXPLORE_SYNC) == -1) {
+        return -1;
+    }
+    if (init_sync_log(SYNC_REPLAY, path, config->n_gnomes, config->n_trees, config->n_levels, 0) == -1) {
+        return -1;
+    }
+
+    int8_t *state = malloc(2 * explorer.state_size);
+    if (state == (int8_t *)0) {
+        kill_sync_log();
+        fprintf(stderr, "explore_check_record: failed to malloc the states\n");
+        return -1;
+    }
+    int8_t *next = state + explorer.state_size;
+
+    printf("explore: checking %lu events of %s against the model\n", sync_log.n_events, path);
+    int result = 0;
+    for (size_t t = 0; t < config->n_trees && result == 0; t++) {
+        unsigned char shown[EXPLORE_N_VIOLATIONS] = { 0 };
+        explore_init_state(state);
+        for (size_t i = 0; i < sync_log.n_events && result == 0; i++) {
+            // finding nothing to pick up is on no tree
+            const struct sync_event *event = &sync_log.events[i];
+            if (event->actor < explorer.n_gnomes && event->tree == t) {
+                result = explore_check_event(state, next, i, event, shown);
+            }
+        }
+        if (result == -1) {
+            printf("explore: the record of tree#%lu is no trace of the model\n", t);
+        }
+    }
+    if (result == 0) {
+        printf("explore: the model takes every step of the record\n");
+    }
+
+    free(state);
+    kill_sync_log();
+    return result;
+}
+
+int main(int argc, char **argv) {
+    char *endptr;
+
+    unsigned n_trees = 1;
+    enum affinity_mode affinity_mode = AFFINITY_NONE;
+    const char *autotune_path = (const char *)0;
+    const char *record_path = (const char *)0;
+    const char *replay_path = (const char *)0;
+    enum explore_grain explore_grain = EXPLORE_LOCK + 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:a:T:r:p:E:")) != -1) {
+        switch (opt) {
+        case 't':
+            n_trees = strtol(optarg, &endptr, 10);
+            if (endptr == optarg) {
+                fprintf(stderr, "ERROR: failed to parse N_TREES\n");
+                USAGE_ERR;
+            }
+            break;
+        case 'a':
+            affinity_mode = AFFINITY_MIGRATE + 1;
+            for (size_t i = 0; i <= AFFINITY_MIGRATE; i++) {
+                if (strcmp(optarg, affinity_modes[i]) == 0) {
+                    affinity_mode = i;
+                }
+            }
+            if (affinity_mode > AFFINITY_MIGRATE) {
+                fprintf(stderr, "ERROR: unknown affinity mode %s\n", optarg);
+                USAGE_ERR;
+            }
+            break;
+        case 'T':
+            autotune_path = optarg;
+            break;
+        case 'r':
+            record_path = optarg;
+            break;
+        case 'p':
+            replay_path = optarg;
+            break;
+        case 'E':
+            explore_grain = EXPLORE_LOCK + 1;
+            for (size_t i = 0; i <= EXPLORE_LOCK; i++) {
+                if (strcmp(optarg, explore_grains[i]) == 0) {
+                    explore_grain = i;
+                }
+            }
+            if (explore_grain > EXPLORE_LOCK) {
+                fprintf(stderr, "ERROR: unknown explore grain %s\n", optarg);
+                USAGE_ERR;
+            }
+            break;
+        default:
+            USAGE_ERR;
+        }
+    }
+
+    if (record_path != (const char *)0 && replay_path != (const char *)0) {
+        fprintf(stderr, "ERROR: a run can't be recorded and replayed at once\n");
+        USAGE_ERR;
+    }
+
+    if (autotune_path != (const char *)0
+            && (record_path != (const char *)0 || replay_path != (const char *)0)) {
+        fprintf(stderr, "ERROR: autotuning runs many configurations, none to record or replay\n");
+        USAGE_ERR;
+    }
+
+    // a record given to the explorer is checked against the model instead
+    unsigned char explore_only = explore_grain <= EXPLORE_LOCK;
+    if (explore_only && (autotune_path != (const char *)0 || record_path != (const char *)0)) {
+        fprintf(stderr, "ERROR: exploring runs nothing to autotune or record\n");
+        USAGE_ERR;
+    }
+    if (explore_only && replay_path != (const char *)0 && explore_grain != EXPLORE_SYNC) {
+        fprintf(stderr, "ERROR: records are made of sync steps, only -E sync checks them\n");
+        USAGE_ERR;
+    }
+
+    // the positional arguments, args[1] is N_GNOMES
+    char **args = argv + optind - 1;
+    int n_args = argc - optind + 1;
+
+    if (n_args < 6) {
+        USAGE_ERR;
+    }
 
-    unsigned n_gnomes = strtol(argv[1], &endptr, 10);
-    if (endptr == argv[1]) {
+    unsigned n_gnomes = strtol(args[1], &endptr, 10);
+    if (endptr == args[1]) {
         fprintf(stderr, "ERROR: failed to parse N_GNOMES\n");
         USAGE_ERR;
     }
 
-    installation_time = strtol(argv[2], &endptr, 10);
-    if (endptr == argv[2]) {
+    useconds_t installation_time = strtol(args[2], &endptr, 10);
+    if (endptr == args[2]) {
         fprintf(stderr, "ERROR: failed to parse ORNAMENT_INSTALLATION_TIME_MICROSECONDS\n");
         USAGE_ERR;
     }
 
-    unsigned ornaments_per_delivery = strtol(argv[3], &endptr, 10);
-    if (endptr == argv[3]) {
+    unsigned ornaments_per_delivery = strtol(args[3], &endptr, 10);
+    if (endptr == args[3]) {
         fprintf(stderr, "ERROR: failed to parse ORNAMENTS_PER_DELIVERY\n");
         USAGE_ERR;
     }
 
-    useconds_t delivery_interval_microseconds = strtol(argv[4], &endptr, 10);
-    if (endptr == argv[4]) {
+    useconds_t delivery_interval_microseconds = strtol(args[4], &endptr, 10);
+    if (endptr == args[4]) {
         fprintf(stderr, "ERROR: failed to parse DELIVERY_INTERVAL_MICROSECONDS\n");
         USAGE_ERR;
     }
 
-    unsigned n_levels = strtol(argv[5], &endptr, 10);
-    if (endptr == argv[5]) {
+    unsigned n_levels = strtol(args[5], &endptr, 10);
+    if (endptr == args[5]) {
         fprintf(stderr, "ERROR: failed to parse N_LEVELS\n");
         USAGE_ERR;
     }
 
-    if (argc != 2 * n_levels + 6) {
+    if (n_args != 2 * n_levels + 6) {
         USAGE_ERR;
     }
 
@@ -690,105 +4358,43 @@ int main(int argc, char **argv) {
 
     for (size_t i = 0; i < n_levels; i++) {
         size_t arg_i = 6 + i;
-        gnome_cap_list[i] = strtol(argv[arg_i], &endptr, 10);
-        if (endptr == argv[arg_i]) {
+        gnome_cap_list[i] = strtol(args[arg_i], &endptr, 10);
+        if (endptr == args[arg_i]) {
             fprintf(stderr, "ERROR: failed to parse GNOME_CAP_%lu\n", i);
             USAGE_ERR;
         }
     }
 
-    ornaments_max = 0;
     for (size_t i = 0; i < n_levels; i++) {
         size_t arg_i = n_levels + 6 + i;
-        ornament_cap_list[i] = strtol(argv[arg_i], &endptr, 10);
-        if (endptr == argv[arg_i]) {
+        ornament_cap_list[i] = strtol(args[arg_i], &endptr, 10);
+        if (endptr == args[arg_i]) {
             fprintf(stderr, "ERROR: failed to parse ORNAMENT_CAP_%lu\n", i);
             USAGE_ERR;
         }
-        ornaments_max += ornament_cap_list[i];
     }
 
-    if (init_ornament_delivery(ornaments_per_delivery, delivery_interval_microseconds) == -1) {
-        fprintf(stderr, "ERROR: failed to initialize the delivery static variable\n");
-        free(gnome_cap_list);
-        free(ornament_cap_list);
-        exit(1);
-    }
+    struct xmas_config config = {
+        .n_trees = n_trees,
+        .affinity_mode = affinity_mode,
+        .n_gnomes = n_gnomes,
+        .installation_time = installation_time,
+        .ornaments_per_delivery = ornaments_per_delivery,
+        .delivery_interval = delivery_interval_microseconds,
+        .n_levels = n_levels,
+        .gnome_cap_list = gnome_cap_list,
+        .ornament_cap_list = ornament_cap_list,
+        .record_path = record_path,
+        .replay_path = replay_path,
+    };
 
-    if (init_xmas_tree(n_gnomes, n_levels, gnome_cap_list, ornament_cap_list) == -1) {
-        fprintf(stderr, "ERROR: failed to initialize the tree static variable\n");
-        free(gnome_cap_list);
-        free(ornament_cap_list);
-        kill_ornament_delivery();
-        exit(1);
-    }
+    int result = explore_only && replay_path != (const char *)0
+            ? explore_check_record(&config, replay_path)
+        : explore_only ? explore(&config, explore_grain)
+        : autotune_path != (const char *)0 ? autotune(&config, autotune_path)
+        : run_xmas_farm(&config);
 
     free(gnome_cap_list);
     free(ornament_cap_list);
-
-    printf("n_gnomes: %u\n", n_gnomes);
-    printf("ornaments_max: %llu\n", ornaments_max);
-    printf("installation_time %u\n", installation_time);
-    printf("ornaments_per_delivery: %u\n", delivery.ornaments_per_delivery);
-    printf("delivey_interval: %u\n", delivery.interval_microseconds);
-    printf("n_levels: %u\n", tree.n_levels);
-    for (size_t i = 0; i < n_levels; i++) {
-        printf(
-            "  level: %lu\n"
-            "    gnome_cap: %u\n"
-            "    ornament_cap: %u\n",
-            i, tree.levels[i].gnome_cap, tree.levels[i].ornament_cap
-        );
-    }
-
-    pthread_t *gnome_threads = (pthread_t *)malloc(sizeof(pthread_t) * n_gnomes);
-    if (gnome_threads == (pthread_t *)0) {
-        fprintf(stderr, "ERROR: failed to allocate memory for thread handles\n");
-        kill_ornament_delivery();
-        kill_xmas_tree();
-        exit(1);
-    }
-    
-    unsigned *gnome_ids = (unsigned *)malloc(sizeof(unsigned) * n_gnomes);
-    if (gnome_ids == (unsigned *)0) {
-        fprintf(stderr, "ERROR: failed to allocate memory for gnome_ids\n");
-        free(gnome_threads);
-        kill_ornament_delivery();
-        kill_xmas_tree();
-        exit(1);
-    }
-
-    for (size_t i = 0; i < n_gnomes; i++) {
-        gnome_ids[i] = (unsigned)i;
-        if (pthread_create(&gnome_threads[i], NULL, gnome, &gnome_ids[i]) != 0) {
-            fprintf(stderr, "ERROR: failed to init gnome_threads[%lu]\n", i);
-            free(gnome_threads);
-            kill_ornament_delivery();
-            kill_xmas_tree();
-            exit(1);
-        }
-    }
-
-    // handle ornament delivery
-    pthread_t santa_thread;
-    if (pthread_create(&santa_thread, NULL, santa, NULL) != 0) {
-        fprintf(stderr, "ERROR: failed to init santa_thread\n");
-        free(gnome_threads);
-        kill_ornament_delivery();
-        kill_xmas_tree();
-        exit(1);
-    }
-
-    // wait for all the threads to complete
-    for (size_t i = 0; i < n_gnomes; i++) {
-        pthread_join(gnome_threads[i], NULL);
-        printf("gnome_threads[%lu] joined\n", i);
-    }
-
-    printf("all gnome_threads joined, terminating\n");
-    
-    // this should never be reached
-    kill_ornament_delivery();
-    kill_xmas_tree();
-    return 0;
+    return result == 0 ? 0 : 1;
 }
@@ -2,6 +2,8 @@ INFILE=main.c
 OUTFILE=./tmpelf
 
 TESTCASE_FILE=$1
+# when given, autotune the testcase into this file instead of running it
+AUTOTUNE_OUTFILE=$2
 [[ ! -e $TESTCASE_FILE ]] && echo "please specify a valid testcase file" && exit 1
 source $TESTCASE_FILE
 
@@ -20,8 +22,17 @@ for KEY in "${ARG_KEYS[@]}"; do
     ARGS+="${!KEY} "
 done
 
+# optional keys, left to the program's defaults when missing
+OPTS=""
+[[ -n "$N_TREES" ]] && OPTS+="-t $N_TREES "
+[[ -n "$AFFINITY" ]] && OPTS+="-a $AFFINITY "
+[[ -n "$RECORD" ]] && OPTS+="-r $RECORD "
+[[ -n "$REPLAY" ]] && OPTS+="-p $REPLAY "
+[[ -n "$EXPLORE" ]] && OPTS+="-E $EXPLORE "
+[[ -n "$AUTOTUNE_OUTFILE" ]] && OPTS+="-T $AUTOTUNE_OUTFILE "
+
 echo "Compiling the program..."
 gcc -Wall -o $OUTFILE $INFILE || exit 1
 echo -e "\nRunning the program...";
-$OUTFILE $ARGS
+$OUTFILE $OPTS$ARGS
 rm $OUTFILE